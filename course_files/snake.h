@@ -7,4 +7,78 @@
 #define SNAKE_GET_WINNER  _IOR(SNAKE_IOC_MAGIC, 0, int)
 #define SNAKE_GET_COLOR   _IOR(SNAKE_IOC_MAGIC, 1, int)
 
+/* SNAKE_SET_READ_FORMAT changes what read() shows, for this file descriptor only.
+the argument is one of the formats below */
+#define SNAKE_SET_READ_FORMAT _IO(SNAKE_IOC_MAGIC, 4)
+#define SNAKE_READ_TEXT   0	/* the board as text (the default) */
+#define SNAKE_READ_BINARY 1	/* struct snake_snapshot followed by the cells, as mmap() shows them */
+#define SNAKE_READ_EVENTS 2	/* a struct snake_event for each move or change of state since the last read */
+
+/* SNAKE_SET_WRITE_MODE changes how write() plays the moves, for this file descriptor only.
+the argument is one of the modes below. either way write() returns once all the moves
+were made (or the game is over), with the number of moves made. in SNAKE_WRITE_TURNS mode,
+a file opened with O_NONBLOCK doesn't wait for turns: write() makes the moves for as long
+as it's the caller's turn, and fails with EAGAIN if it isn't at first */
+#define SNAKE_SET_WRITE_MODE _IO(SNAKE_IOC_MAGIC, 6)
+#define SNAKE_WRITE_TURNS  0	/* the writer waits for each turn and makes the move (the default) */
+#define SNAKE_WRITE_QUEUED 1	/* the moves are queued, and made for the writer as its turns come.
+								the writer only wakes up when they're all made, or the game ends */
+
+/* the dimensions of a game's board. the board is size x size, each snake starts with
+snake_size segments and survives hunger turns without eating. a game's board can only
+be changed before the first move */
+struct snake_board {
+	int size;
+	int snake_size;
+	int hunger;
+};
+#define SNAKE_SET_BOARD   _IOW(SNAKE_IOC_MAGIC, 2, struct snake_board)
+#define SNAKE_GET_BOARD   _IOR(SNAKE_IOC_MAGIC, 3, struct snake_board)
+
+/* SNAKE_WAIT sleeps until it's the caller's turn, more than moves moves have been made (if
+moves isn't negative) or the game is over, whichever comes first. it gives up after timeout
+milliseconds (never, if timeout is negative). returns the number of moves made so far, or
+fails with ETIMEDOUT */
+struct snake_wait {
+	int moves;
+	int timeout;
+};
+#define SNAKE_WAIT        _IOW(SNAKE_IOC_MAGIC, 5, struct snake_wait)
+
+/* what mmap() of a game shows, read only and starting at offset 0: this header, followed by
+the board's cells row by row (see SNAKE_CELLS). a cell is cell_size bytes, signed, and holds
+1 for the white snake, -1 for the black snake, 0 if it's empty and anything else for food.
+the module updates all of it in place. seq is odd while an update is in progress, so to get
+a consistent copy read seq, copy, and read seq again. if it was odd or has changed, retry */
+struct snake_snapshot {
+	volatile unsigned int seq;
+	int size;			/* the board is size x size */
+	int cell_size;
+	int moves;			/* moves made so far */
+	int white_length;
+	int black_length;
+	int white_hunger;	/* moves left before starving */
+	int black_hunger;
+	int turn;			/* the color (as SNAKE_GET_COLOR) whose turn it is, 0 if the game isn't on
+						   or while a move is being made */
+	int winner;			/* as SNAKE_GET_WINNER */
+};
+#define SNAKE_CELLS(snapshot) ((char*)((snapshot)+1))
+/* the size of the snapshot (and of a SNAKE_READ_BINARY read) of a board */
+#define SNAKE_SNAPSHOT_SIZE(size,cell_size) (sizeof(struct snake_snapshot) + (size)*(size)*(cell_size))
+
+/* what a SNAKE_READ_EVENTS read returns, as many whole events as fit (0 bytes if nothing
+happened since the last read). each game keeps its latest SNAKE_EVENT_LOG events, and
+a reader that falls further behind skips ahead, leaving a gap in the numbers */
+struct snake_event {
+	int number;			/* events of a game are numbered from 0 */
+	char player;		/* the color (as SNAKE_GET_COLOR) that moved, 0 for a change of state */
+	char direction;		/* the move ('2', '4', '6' or '8'), 0 for a change of state */
+	char ate;			/* 1 if the move ate the food */
+	signed char winner;	/* as SNAKE_GET_WINNER, after the event */
+	short food_x;		/* where the food is after the event, -1 if there's none */
+	short food_y;
+};
+#define SNAKE_EVENT_LOG 256
+
 #endif /* _SNAKE_H_ */
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE		// For sched_setaffinity()
+#include "test_snake.h"
+#include <sys/time.h>	// For gettimeofday()
+#include <sched.h>		// For sched_setaffinity()
+
+/*******************************************************************************************
+ ===========================================================================================
+ ===========================================================================================
+                                   BENCHMARK UTILITIES
+ ===========================================================================================
+ ===========================================================================================
+ ******************************************************************************************/
+// Games installed for each benchmark round. Games can't be re-opened after release(),
+// so every round reinstalls the module.
+#define BENCH_GAMES 50
+
+// Food seed passed to the module, so every run of a benchmark sees the same food
+#define BENCH_SEED 234123
+
+#define BENCH_AREA(name) do { \
+		int i; \
+		for(i=0; i<PRINT_WIDTH; ++i) printf("-"); \
+		printf("\nBenchmark: "name"\n"); \
+		for(i=0; i<PRINT_WIDTH; ++i) printf("-"); \
+		printf("\n"); \
+	} while(0)
+
+// Like setup_snake(), but installs the module with BENCH_SEED as the food seed
+void setup_bench(int n) {
+	char n_char[4], seed_char[12];
+	sprintf(n_char, "%d", n);
+	sprintf(seed_char, "%d", BENCH_SEED);
+	char *argv[] = { INSTALL_SCRIPT, n_char, seed_char, '\0'};
+	if (!fork()) {
+		execv(INSTALL_SCRIPT, argv);
+		exit(0);
+	}
+	else {
+		P_WAIT();
+		installed = TRUE;
+	}
+}
+
+// Current time, in microseconds
+double now_usec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1000000.0 + tv.tv_usec;
+}
+
+// Opens both players of a game from the same process, so a single thread can play both
+// sides and never has to wait for its turn. The white player's open() blocks until the
+// black player joins, so do that one in a thread.
+void* open_white_func(void* arg) {
+	int* fd = (int*)arg;
+	*fd = open(node_name, O_RDWR);
+	return NULL;
+}
+bool open_both(int minor, int* w_fd, int* b_fd) {
+	pthread_t tid;
+	get_node_name(minor);
+	pthread_create(&tid, NULL, open_white_func, (void*)w_fd);
+	usleep(1000);	// Let the thread be the white player
+	*b_fd = open(node_name, O_RDWR);
+	pthread_join(tid, NULL);
+	return *w_fd >= 0 && *b_fd >= 0 && ioctl(*w_fd,SNAKE_GET_COLOR) == WHITE_COLOR;
+}
+
+// Picks a move that heads for the food without losing. color_mod is 1 for the white
+// player and -1 for the black player. Returns the move's character (0 if every move loses),
+// and sets *eats if the move lands on the food.
+char greedy_move(Matrix* m, int color_mod, bool* eats) {
+	int i,j,hx=-1,hy=-1,fx=-1,fy=-1,tail=0;
+	for (i=0; i<N; ++i)
+		for (j=0; j<N; ++j) {
+			if ((*m)[i][j] == color_mod) { hy=i; hx=j; }
+			if ((*m)[i][j] == FOOD) { fy=i; fx=j; }
+			if ((*m)[i][j] != FOOD && (*m)[i][j]*color_mod > tail) tail = (*m)[i][j]*color_mod;
+		}
+	char moves[] = {'2','4','6','8'};
+	int dx[] = {0,-1,1,0}, dy[] = {1,0,0,-1};
+	char best = 0;
+	int best_dist = 4*N;
+	for (i=0; i<4; ++i) {
+		int x = hx+dx[i], y = hy+dy[i];
+		if (x<0 || y<0 || x>=N || y>=N)
+			continue;
+		if ((*m)[y][x] != EMPTY && (*m)[y][x] != FOOD && (*m)[y][x] != tail*color_mod)
+			continue;
+		int dist = (fx<0) ? 0 : abs(fx-x)+abs(fy-y);
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = moves[i];
+			*eats = ((*m)[y][x] == FOOD);
+		}
+	}
+	return best;
+}
+
+// Pins the calling process to a CPU (modulo the number of CPUs), where the C library
+// can do it. Otherwise this does nothing, and the scheduler decides.
+void pin_to_cpu(int cpu) {
+#ifdef CPU_SET
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Number of snake segments (of both colors) on the board
+int occupied_cells(Matrix* m) {
+	int i,j,total=0;
+	for (i=0; i<N; ++i)
+		for (j=0; j<N; ++j)
+			if ((*m)[i][j] != EMPTY && (*m)[i][j] != FOOD)
+				++total;
+	return total;
+}
+
+/*******************************************************************************************
+ ===========================================================================================
+ ===========================================================================================
+                                       BENCHMARKS
+ ===========================================================================================
+ ===========================================================================================
+ ******************************************************************************************/
+
+// Cost of placing food, against how full the board is.
+// Both snakes greedily chase the food, and every write() is timed. A move that eats
+// makes the module place new food, so (eating move - plain move) is the placement cost.
+// Results are grouped by the number of occupied cells before the move.
+void bench_food_placement() {
+	double eat_time[N*N+1] = {0}, plain_time[N*N+1] = {0};
+	int eat_count[N*N+1] = {0}, plain_count[N*N+1] = {0};
+	int round, minor, rounds = 20;
+	for (round=0; round<rounds; ++round) {
+		UPDATE_PROG(round*100/rounds);
+		setup_bench(BENCH_GAMES);
+		for (minor=0; minor<BENCH_GAMES; ++minor) {
+			int fds[2];
+			if (!open_both(minor, fds, fds+1))
+				break;
+			int turn = 0;
+			while (ioctl(fds[0],SNAKE_GET_WINNER) == -1) {
+				Matrix m;
+				bool eats = FALSE;
+				if (!read_and_parse(fds[turn],&m))
+					break;
+				char move = greedy_move(&m, turn ? -1 : 1, &eats);
+				if (!move)
+					break;
+				int fill = occupied_cells(&m);
+				double start = now_usec();
+				if (write(fds[turn],&move,1) != 1)
+					break;
+				double elapsed = now_usec() - start;
+				if (eats) {
+					eat_time[fill] += elapsed;
+					eat_count[fill]++;
+				}
+				else {
+					plain_time[fill] += elapsed;
+					plain_count[fill]++;
+				}
+				turn = !turn;
+			}
+			close(fds[0]);
+			close(fds[1]);
+		}
+		destroy_snake();
+	}
+	printf("   \n%10s %10s %12s %12s\n","fill","eats","eat (us)","plain (us)");
+	int fill;
+	for (fill=0; fill<=N*N; ++fill) {
+		if (!eat_count[fill])
+			continue;
+		printf("%9d%% %10d %12.2f %12.2f\n", fill*100/(N*N), eat_count[fill],
+				eat_time[fill]/eat_count[fill],
+				plain_count[fill] ? plain_time[fill]/plain_count[fill] : 0.0);
+	}
+}
+
+// Move throughput against the total working set, for the cell encoding this was compiled
+// with (see CELL_BITS in hw3q1.h and bench.sh).
+// All the games are open at once and played round robin, one move each, so the boards of
+// every game compete for the cache. The snakes start with 1 segment, never starve, and
+// circle a 2x2 square, so a game only ends if its snake eats food 4 times.
+void bench_move_throughput() {
+	int sizes[] = {4, 16, 32, 64, 128};
+	int fds[BENCH_GAMES][2];
+	bool alive[BENCH_GAMES];
+	int s, minor, round, rounds = 2000;
+	printf("Cell encoding: %d bits, %.1f bytes per cell (on a %dx%d board)\n", CELL_BITS,
+			(double)BOARD_MEM_SIZE(MAX_N)/(MAX_N*MAX_N), MAX_N, MAX_N);
+	printf("%10s %16s %12s %14s\n","board","working set(KB)","moves","moves/sec");
+	for (s=0; s<sizeof(sizes)/sizeof(*sizes); ++s) {
+		struct snake_board dims = {sizes[s], 1, 1<<30};
+		int games = 0, moves = 0;
+		setup_bench(BENCH_GAMES);
+		for (minor=0; minor<BENCH_GAMES; ++minor) {
+			alive[minor] = open_both(minor, fds[minor], fds[minor]+1) &&
+					!ioctl(fds[minor][0],SNAKE_SET_BOARD,&dims);
+			games += alive[minor];
+		}
+		double start = now_usec();
+		for (round=0; round<rounds; ++round) {
+			for (minor=0; minor<BENCH_GAMES; ++minor) {
+				if (!alive[minor])
+					continue;
+				if (write(fds[minor][0],&WHITE_LOOP[round%4],1) != 1 ||
+						write(fds[minor][1],&BLACK_LOOP[round%4],1) != 1) {
+					alive[minor] = FALSE;
+					continue;
+				}
+				moves += 2;
+			}
+		}
+		double elapsed = now_usec() - start;
+		for (minor=0; minor<BENCH_GAMES; ++minor) {
+			close(fds[minor][0]);
+			close(fds[minor][1]);
+		}
+		destroy_snake();
+		printf("%6dx%-3d %16.1f %12d %14.0f\n", sizes[s], sizes[s],
+				games*BOARD_MEM_SIZE(sizes[s])/1024.0, moves, moves*1000000.0/elapsed);
+	}
+}
+
+// Reads of the whole board per second, against the number of threads reading the same
+// game at once. Every reader pread()s the board from the top, through one of the two
+// players' files, for BENCH_READ_USEC. Reads take grid_lock for reading, so they should
+// scale with the readers (up to the number of CPUs) rather than queue up behind each other.
+#define BENCH_READ_USEC 1000000
+#define MAX_READERS 16
+
+int read_fds[2];
+char read_bufs[MAX_READERS][BUF_SIZE(32)];
+volatile bool readers_go = FALSE;
+volatile bool readers_stop = FALSE;
+
+void* reader_func(void* arg) {
+	long i = (long)arg, reads = 0;
+	while (!readers_go)
+		;
+	while (!readers_stop)
+		if (pread(read_fds[i%2], read_bufs[i], sizeof(read_bufs[i]), 0) == sizeof(read_bufs[i]))
+			++reads;
+	return (void*)reads;
+}
+
+void bench_read_scaling() {
+	int counts[] = {1, 2, 4, 8, MAX_READERS};
+	struct snake_board dims = {32, 1, 1<<30};
+	pthread_t readers[MAX_READERS];
+	int c;
+	long i;
+	printf("%10s %14s %16s\n","readers","reads/sec","per reader");
+	for (c=0; c<sizeof(counts)/sizeof(*counts); ++c) {
+		long total = 0;
+		void* reads;
+		setup_bench(1);
+		if (!open_both(0, read_fds, read_fds+1) || ioctl(read_fds[0],SNAKE_SET_BOARD,&dims) ||
+				write(read_fds[0],WHITE_LOOP,1) != 1) {		// Give the text cache a move to render
+			printf("%10d %14s\n", counts[c], "failed");
+			destroy_snake();
+			continue;
+		}
+		readers_go = readers_stop = FALSE;
+		for (i=0; i<counts[c]; ++i)
+			pthread_create(readers+i, NULL, reader_func, (void*)i);
+		double start = now_usec();
+		readers_go = TRUE;
+		usleep(BENCH_READ_USEC);
+		readers_stop = TRUE;
+		for (i=0; i<counts[c]; ++i) {
+			pthread_join(readers[i], &reads);
+			total += (long)reads;
+		}
+		double elapsed = now_usec() - start;
+		close(read_fds[0]);
+		close(read_fds[1]);
+		destroy_snake();
+		printf("%10d %14.0f %16.0f\n", counts[c], total*1000000.0/elapsed,
+				total*1000000.0/elapsed/counts[c]);
+	}
+}
+
+// Round trip latency of handing the turn over, between two processes pinned to different
+// CPUs (if there are two). The white player (this process) times each of its moves from the
+// end of its previous one: black's turn is handed over, black moves, and white's turn is
+// handed back. This is what limits a bot-vs-bot match, where neither player thinks long.
+void bench_turn_latency() {
+	int i, fd, samples = 0, rounds = 20000;
+	struct snake_board dims = {MAX_N, 1, 1<<30};
+	double* trip = malloc(rounds*sizeof(double));
+	setup_bench(1);
+	get_node_name(0);
+	pid_t pid = fork();
+	if (!pid) {
+		pin_to_cpu(1);
+		usleep(1000);	// Let the father be the white player
+		fd = open(node_name, O_RDWR);
+		for (i=0; i<rounds && write(fd,&BLACK_LOOP[i%4],1) == 1; ++i)
+			;
+		close(fd);
+		exit(0);
+	}
+	pin_to_cpu(0);
+	fd = open(node_name, O_RDWR);
+	if (fd < 0 || ioctl(fd,SNAKE_SET_BOARD,&dims)) {	// Black waits for white's first move
+		printf("Can't start the game\n");
+		kill(pid, SIGKILL);
+	}
+	else {
+		double last = now_usec();
+		for (i=0; i<rounds; ++i) {
+			if (write(fd,&WHITE_LOOP[i%4],1) != 1)
+				break;
+			double now = now_usec();
+			if (i)		// The first move doesn't wait for black
+				trip[samples++] = now - last;
+			last = now;
+		}
+	}
+	waitpid(pid, NULL, 0);		// Black moves last, don't close the game on it
+	close(fd);
+	destroy_snake();
+	if (!samples) {
+		free(trip);
+		return;
+	}
+	qsort(trip, samples, sizeof(*trip), compare_doubles);
+	printf("%12s %12s %12s %12s\n","round trips","p50 (us)","p99 (us)","max (us)");
+	printf("%12d %12.2f %12.2f %12.2f\n", samples, trip[samples/2], trip[samples*99/100],
+			trip[samples-1]);
+	free(trip);
+}
+
+// Total moves per second of games played side by side, one process per game, each pinned
+// to a CPU of its own (as far as there are enough). Each process plays both sides of its
+// game, like bench_move_throughput(). The games share nothing, so the total should grow
+// with the number of games up to the number of CPUs, and not drop as neighbouring games
+// in the module's table get busy.
+void bench_parallel_games() {
+	int counts[] = {1, 2, 4, 8};
+	struct snake_board dims = {32, 1, 1<<30};
+	int c, p, rounds = 50000;
+	char byte;
+	printf("CPUs: %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%10s %14s %14s %10s\n","games","moves/sec","per game","failed");
+	for (c=0; c<sizeof(counts)/sizeof(*counts); ++c) {
+		int ready[2], go[2], status, failed = 0;
+		setup_bench(BENCH_GAMES);
+		pipe(ready);
+		pipe(go);
+		for (p=0; p<counts[c]; ++p) {
+			if (!fork()) {
+				int fds[2], i;
+				pin_to_cpu(p);
+				bool ok = open_both(p, fds, fds+1) && !ioctl(fds[0],SNAKE_SET_BOARD,&dims);
+				write(ready[1], "r", 1);
+				read(go[0], &byte, 1);		// Start together
+				for (i=0; ok && i<rounds; ++i)
+					ok = write(fds[0],&WHITE_LOOP[i%4],1) == 1 && write(fds[1],&BLACK_LOOP[i%4],1) == 1;
+				close(fds[0]);
+				close(fds[1]);
+				exit(!ok);
+			}
+		}
+		for (p=0; p<counts[c]; ++p)
+			read(ready[0], &byte, 1);
+		double start = now_usec();
+		for (p=0; p<counts[c]; ++p)
+			write(go[1], "g", 1);
+		while (wait(&status) != -1)
+			failed += !WIFEXITED(status) || WEXITSTATUS(status);
+		double elapsed = now_usec() - start;
+		close(ready[0]);
+		close(ready[1]);
+		close(go[0]);
+		close(go[1]);
+		destroy_snake();
+		double moves = 2.0*rounds*(counts[c]-failed);	// Games that ended early aren't counted
+		printf("%10d %14.0f %14.0f %10d\n", counts[c], moves*1000000.0/elapsed,
+				counts[c] > failed ? moves*1000000.0/elapsed/(counts[c]-failed) : 0.0, failed);
+	}
+}
+
+/*******************************************************************************************
+ ===========================================================================================
+ ===========================================================================================
+										MAIN
+ ===========================================================================================
+ ===========================================================================================
+ ******************************************************************************************/
+
+int main() {
+
+	// Prevent output buffering, so the progress indicators show up
+	setbuf(stdout, NULL);
+
+	BENCH_AREA("food placement vs. board fill");
+	bench_food_placement();
+
+	BENCH_AREA("move throughput vs. working set");
+	bench_move_throughput();
+
+	BENCH_AREA("concurrent reads vs. readers");
+	bench_read_scaling();
+
+	BENCH_AREA("turn handoff latency");
+	bench_turn_latency();
+
+	BENCH_AREA("move throughput vs. games in parallel");
+	bench_parallel_games();
+
+	return 0;
+
+}
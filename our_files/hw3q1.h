@@ -5,16 +5,21 @@
 /*=========================================================================
 Constants and definitions:
 ==========================================================================*/
+/* these are the defaults. each board has its own n, m and k (see Board), which can be set
+when the module is loaded or per game */
 #define N (4) /* the size of the board */
 #define M (3)  /* the initial size of the snake */
 #define K (5)  /* the number of turns a snake can survive without eating */
+#define MAX_N (128) /* the largest board allowed */
 
 typedef char Player;
 /* PAY ATTENTION! i will use the fact that white is positive one and black is negative
 one to describe the segments of the snake. for example, if the white snake is 2 segments
 long and the black snake is 3 segments long
 white snake is  1   2
-black snake is -1  -2  -3 */
+black snake is -1  -2  -3
+the board itself only stores WHITE or BLACK in each of a snake's cells. the numbers are
+produced by Print(), which gets them from the snakes' bookkeeping (see Snake below) */
 #define WHITE ( 1) /* id to the white player */
 #define BLACK (-1) /* id to the black player */
 #define EMPTY ( 0) /* to describe an empty point */
@@ -32,14 +37,93 @@ typedef int Direction;
 #define RIGHT (6)
 #define UP    (8)
 
-/* a point in 2d space */
+/* a point in 2d space. coordinates are below MAX_N, or just off the board */
 typedef struct {
-	int x, y;
+	short x, y;
 } Point;
 
-
+/* a cell only holds its owner (WHITE, BLACK, EMPTY or FOOD), so 8 bits are plenty for
+any board. CELL_BITS can be set to 16 or 32 when compiling, to compare the encodings */
+#ifndef CELL_BITS
+#define CELL_BITS 8
+#endif
+#if CELL_BITS == 8
+typedef signed char Cell;
+#elif CELL_BITS == 16
+typedef short Cell;
+#else
+typedef int Cell;
+#endif
+
+/* an index into the cells of a board, sized for the largest board */
+#if MAX_N*MAX_N <= 0x10000
+typedef unsigned short CellIndex;
+#else
+typedef int CellIndex;
+#endif
+
+
+/* a board of the default size, as parsed from the output of Print() */
 typedef int Matrix[N][N];
 
+/* occupancy bitmaps have one bit per cell, row by row like the cells themselves */
+typedef unsigned int BitWord;
+#define WORD_BITS (8*sizeof(BitWord))
+/* the number of words in the bitmap of an n x n board */
+#define BIT_WORDS(n) (((n)*(n) + WORD_BITS - 1) / WORD_BITS)
+
+/* a snake's body, kept as a circular buffer of locations. segments[head] is the head,
+segments[tail] is the tail and the slots in between (going forward and wrapping around) are
+the rest of the body in order. this way a move only touches the two ends of the snake */
+typedef struct {
+	Point* segments;
+	int slots;	/* the size of segments[] (n*n, so the snake always fits) */
+	int head;
+	int tail;
+} Snake;
+
+/* the slot before i in a snake's circular buffer */
+#define PREV_SLOT(snake,i) (((i) + (snake)->slots - 1) % (snake)->slots)
+/* the number of segments in a snake */
+#define SNAKE_SIZE(snake) (((snake)->tail - (snake)->head + (snake)->slots) % (snake)->slots + 1)
+/* the location of segment number i in a snake (1 is the head) */
+#define SEGMENT(snake,i) ((snake)->segments[((snake)->head + (i) - 1) % (snake)->slots])
+
+/* the game grid, along with the bookkeeping of both snakes on it.
+all the arrays have n*n entries and are allocated together, free_cells first */
+typedef struct {
+	int n;			/* the board is n x n */
+	int m;			/* the initial size of the snakes */
+	int k;			/* the number of turns a snake can survive without eating */
+	Cell* matrix;	/* the cells, row by row. use CELL() */
+	Snake white;
+	Snake black;
+	/* the EMPTY cells, in no particular order, so food can be placed without searching.
+	free_slot says where each EMPTY cell is in free_cells (other cells hold garbage) */
+	Point* free_cells;
+	CellIndex* free_slot;
+	int free_count;
+	/* which cells each snake covers, and where the food is. they always agree with
+	matrix, so cells can be checked (and counted) a word at a time */
+	BitWord* white_bits;
+	BitWord* black_bits;
+	BitWord* food_bits;
+	Point food;		/* where the food is, (-1,-1) if the board is full */
+	unsigned int rand_state;	/* food placement generator, see SeedRand() */
+	int moves;		/* the number of moves made on the board */
+} Board;
+
+/* the cell at point p */
+#define CELL(board,p) ((board)->matrix[(p).y*(board)->n + (p).x])
+/* the bit of point p in a bitmap of the board */
+#define BIT_INDEX(board,p) ((p).y*(board)->n + (p).x)
+#define TEST_BIT(bits,i) (((bits)[(i)/WORD_BITS] >> ((i)%WORD_BITS)) & 1)
+#define SET_BIT(bits,i) ((bits)[(i)/WORD_BITS] |= 1U << ((i)%WORD_BITS))
+#define CLEAR_BIT(bits,i) ((bits)[(i)/WORD_BITS] &= ~(1U << ((i)%WORD_BITS)))
+/* the size in bytes of the arrays of an n x n board */
+#define BOARD_MEM_SIZE(n) ((n)*(n)*(sizeof(Cell) + sizeof(CellIndex) + 3*sizeof(Point)) + \
+		3*BIT_WORDS(n)*sizeof(BitWord))
+
 // ERR_ILLEGAL_MOVE means the move was valid input but illegal in the game (loss)
 typedef enum {
 	ERR_OK,
@@ -50,33 +134,30 @@ typedef enum {
 	ERR_SEGMENT_NOT_FOUND,
 } ErrorCode;
 
-// The minimal buffer size (in chars) for printing the board, without NULL termination.
+// The minimal buffer size (in chars) for printing an n x n board, without NULL termination.
 // Make this a macro so the size is known at compile-time.
-#define GOOD_BUF_SIZE (3*N*N+10*N+8)
-
-ErrorCode Init(Matrix*);
-bool IsAvailable(Matrix*, Point);
-ErrorCode RandFoodLocation(Matrix*);
-bool IsMatrixFull(Matrix*);
-void Print(Matrix*, char*, int);
-ErrorCode Update(Matrix*, Player, Direction, int*);
-ErrorCode GetInputLoc(Matrix*, Player, Point*, Direction);
-ErrorCode GetSegment(Matrix*, int, Point*);
-bool CheckTarget(Matrix*, Player, Point);
-int GetSize(Matrix*, Player);
-ErrorCode CheckFoodAndMove(Matrix*, Player, Point, int*);
-void IncSizePlayer(Matrix*, Player, Point);
-void AdvancePlayer(Matrix*, Player, Point);
-
-
-bool IsMatrixFull(Matrix *matrix) {
-	Point p;
-	for (p.x = 0; p.x < N; ++p.x)
-		for (p.y = 0; p.y < N; ++p.y)
-			if ((*matrix)[p.y][p.x] == EMPTY || (*matrix)[p.y][p.x] == FOOD)
-				return FALSE;
-	
-	return TRUE;
+#define BUF_SIZE(n) (3*(n)*(n)+10*(n)+8)
+#define GOOD_BUF_SIZE BUF_SIZE(N)	// For the default board
+
+ErrorCode Init(Board*);
+bool IsAvailable(Board*, Point);
+ErrorCode RandFoodLocation(Board*);
+bool IsMatrixFull(Board*);
+void Print(Board*, char*, int);
+ErrorCode Update(Board*, Player, Direction, int*);
+ErrorCode GetInputLoc(Board*, Player, Point*, Direction);
+ErrorCode GetSegment(Board*, int, Point*);
+bool CheckTarget(Board*, Player, Point);
+int GetSize(Board*, Player);
+ErrorCode CheckFoodAndMove(Board*, Player, Point, int*);
+void IncSizePlayer(Board*, Player, Point);
+void AdvancePlayer(Board*, Player, Point);
+
+
+// The board is full when there are no EMPTY or FOOD cells left, i.e. when the snakes
+// cover all of it. The snakes know their sizes, so there's no need to look at the matrix.
+bool IsMatrixFull(Board *board) {
+	return SNAKE_SIZE(&board->white) + SNAKE_SIZE(&board->black) == board->n * board->n;
 }
 
 
@@ -87,20 +168,20 @@ bool IsMatrixFull(Matrix *matrix) {
 		else return; \
 	} while(0)
 
-void Print(Matrix *matrix, char* buf, int size) {
+void PrintGrid(Board *board, char* buf, int size) {
 	int i;
 	int j=0;
 	Point p;
-	for (i = 0; i < N + 1; ++i) {				// (N+1)*3
+	for (i = 0; i < board->n + 1; ++i) {		// (N+1)*3
 		BUF_W('-');
 		BUF_W('-');
 		BUF_W('-');
 	}
 	BUF_W('\n');							// 1
-	for (p.y = 0; p.y < N; ++p.y) {				// N*
+	for (p.y = 0; p.y < board->n; ++p.y) {		// N*
 		BUF_W('|');								// 1+
-		for (p.x = 0; p.x < N; ++p.x) {				// N*
-			switch ((*matrix)[p.y][p.x]) {				// 3
+		for (p.x = 0; p.x < board->n; ++p.x) {		// N*
+			switch (CELL(board,p)) {					// 3
 			case FOOD:
 				BUF_W(' ');
 				BUF_W(' ');
@@ -111,17 +192,17 @@ void Print(Matrix *matrix, char* buf, int size) {
 				BUF_W(' ');
 				BUF_W('.');
 				break;
-			default:
+			default:								// Segment number is filled in later
+				BUF_W(' ');
+				BUF_W(CELL(board,p) == BLACK? '-' : ' ');
 				BUF_W(' ');
-				BUF_W((*matrix)[p.y][p.x] < 0? '-' : ' ');
-				BUF_W((char)('0'+((*matrix)[p.y][p.x] < 0 ? -(*matrix)[p.y][p.x] : (*matrix)[p.y][p.x])));
 			}
 		}
 		BUF_W(' ');								// +3
 		BUF_W('|');
 		BUF_W('\n');
 	}											// Sub total: (N+1)*3+1+N*(1+3*N+3)
-	for (i = 0; i < N + 1; ++i) {				// (N+1)*3
+	for (i = 0; i < board->n + 1; ++i) {		// (N+1)*3
 		BUF_W('-');
 		BUF_W('-');
 		BUF_W('-');
@@ -135,5 +216,26 @@ void Print(Matrix *matrix, char* buf, int size) {
 	
 }
 
+
+// Offset of the 3 characters describing the point p in the output of Print() (n x n board)
+#define CELL_OFFSET(n,p) (3*((n)+1)+1 + (p).y*(3*(n)+4) + 1 + 3*(p).x)
+
+// The matrix doesn't know the segment numbers, so walk the snake and write them
+// over the placeholders left by PrintGrid(). Stays within the same limit.
+void PrintSegments(Board *board, Snake *snake, char* buf, int size) {
+	int i, j;
+	for (i = 1; i <= SNAKE_SIZE(snake); ++i) {
+		j = CELL_OFFSET(board->n, SEGMENT(snake,i)) + 2;
+		if (j < size)
+			buf[j] = (char)('0'+i);
+	}
+}
+
+void Print(Board *board, char* buf, int size) {
+	PrintGrid(board, buf, size);
+	PrintSegments(board, &board->white, buf, size);
+	PrintSegments(board, &board->black, buf, size);
+}
+
 #endif /* _HW3Q1_H */
 
@@ -5,8 +5,17 @@
 #include <asm-i386/semaphore.h>
 #include <linux/fs.h>
 #include <asm-i386/uaccess.h>	// For copy_to/from_user
+#include <asm-i386/system.h>	// For cmpxchg(), which changes the game state
 #include "hw3q1.h"				// For some definitions
-#include <linux/random.h>		// For get_random_bytes()
+#include <linux/random.h>		// For get_random_bytes(), when there's no food_seed
+#include <linux/vmalloc.h>		// For the boards
+#include <linux/bitops.h>		// For hweight32()
+#include <linux/mm.h>			// For mmap()
+#include <linux/wrapper.h>		// For mem_map_reserve(), see alloc_snapshot()
+#include <linux/slab.h>			// For kmalloc()
+#include <linux/poll.h>			// For poll()
+#include <linux/sched.h>		// For SNAKE_WAIT's sleep
+#include <linux/cache.h>		// For ____cacheline_aligned
 MODULE_LICENSE("GPL");
 
 /*******************************************************************************************
@@ -41,75 +50,143 @@ MODULE_LICENSE("GPL");
  ===========================================================================================
  ===========================================================================================
  ******************************************************************************************/
-ErrorCode Init(Matrix *matrix) {
+// Keep track of the EMPTY cells. Removal moves the last cell into the hole, so
+// both operations are O(1).
+void AddFreeCell(Board *board, Point p) {
+	board->free_slot[p.y*board->n + p.x] = board->free_count;
+	board->free_cells[board->free_count++] = p;
+}
+
+void RemoveFreeCell(Board *board, Point p) {
+	int slot = board->free_slot[p.y*board->n + p.x];
+	Point last = board->free_cells[--board->free_count];
+	board->free_cells[slot] = last;
+	board->free_slot[last.y*board->n + last.x] = slot;
+}
+
+// The bitmap a player's snake is marked in
+BitWord* GetSnakeBits(Board *board, Player player) {
+	return player == WHITE ? board->white_bits : board->black_bits;
+}
+
+// Expects the dimensions and arrays of the board to be set up already (see alloc_board())
+ErrorCode Init(Board *board) {
 	// Start by emptying everything
-	int i,j;
-	for (i=0; i<N; ++i)
-		for (j=0; j<N; ++j)
-			(*matrix)[i][j] = EMPTY;
+	Point p;
+	int i;
+	board->free_count = 0;
+	board->moves = 0;
+	for (i = 0; i < BIT_WORDS(board->n); ++i)
+		board->white_bits[i] = board->black_bits[i] = board->food_bits[i] = 0;
+	for (p.y=0; p.y<board->n; ++p.y)
+		for (p.x=0; p.x<board->n; ++p.x) {
+			CELL(board,p) = EMPTY;
+			AddFreeCell(board, p);
+		}
 	
 	/* initialize the snakes location */
-	for (i = 0; i < M; ++i) {
-		(*matrix)[0][i] =   WHITE * (i + 1);
-		(*matrix)[N - 1][i] = BLACK * (i + 1);
+	board->white.head = board->black.head = 0;
+	board->white.tail = board->black.tail = board->m - 1;
+	board->white.slots = board->black.slots = board->n * board->n;
+	for (i = 0; i < board->m; ++i) {
+		board->white.segments[i].x = board->black.segments[i].x = i;
+		board->white.segments[i].y = 0;
+		board->black.segments[i].y = board->n - 1;
+		CELL(board,board->white.segments[i]) = WHITE;
+		CELL(board,board->black.segments[i]) = BLACK;
+		SET_BIT(board->white_bits, BIT_INDEX(board,board->white.segments[i]));
+		SET_BIT(board->black_bits, BIT_INDEX(board,board->black.segments[i]));
+		RemoveFreeCell(board, board->white.segments[i]);
+		RemoveFreeCell(board, board->black.segments[i]);
 	}
 	/* initialize the food location */
-	if (RandFoodLocation(matrix) != ERR_OK)
+	if (RandFoodLocation(board) != ERR_OK)
 		return ERR_BOARD_FULL;
 	
 	return ERR_OK;
 }
 
-bool OutOfBounds(Point p) {
-	return (p.x < 0 || p.x >(N - 1) || p.y < 0 || p.y >(N - 1));
+bool OutOfBounds(Board *board, Point p) {
+	return (p.x < 0 || p.x >(board->n - 1) || p.y < 0 || p.y >(board->n - 1));
 }
 
-bool IsAvailable(Matrix *matrix, Point p) {
-	return
-		/* is out of bounds */
-		!(OutOfBounds(p) ||
-		/* is empty */
-		((*matrix)[p.y][p.x] != EMPTY && (*matrix)[p.y][p.x] != FOOD));
+Snake* GetSnake(Board *board, Player player) {
+	return player == WHITE ? &board->white : &board->black;
 }
 
-ErrorCode RandFoodLocation(Matrix *matrix) {
+bool IsAvailable(Board *board, Point p) {
+	int i;
+	/* is out of bounds */
+	if (OutOfBounds(board, p))
+		return FALSE;
+	/* is empty or food, i.e. no snake is there */
+	i = BIT_INDEX(board,p);
+	return !TEST_BIT(board->white_bits,i) && !TEST_BIT(board->black_bits,i);
+}
+
+// The number of EMPTY cells, counted a word at a time. Bits past the last cell are never
+// set, so they look free and are taken off the total.
+int CountFreeCells(Board *board) {
+	int i, taken = 0;
+	for (i = 0; i < BIT_WORDS(board->n); ++i)
+		taken += hweight32(board->white_bits[i] | board->black_bits[i] | board->food_bits[i]);
+	return board->n * board->n - taken;
+}
+
+// Each board has its own xorshift generator (Marsaglia) for placing food. It's much
+// cheaper than the kernel's entropy pool, and games don't contend over it.
+// The same seed always gives the same food.
+void SeedRand(Board *board, unsigned int seed) {
+	board->rand_state = seed * 2654435761U;	// Spread consecutive seeds apart
+	if (!board->rand_state)					// xorshift never leaves 0
+		board->rand_state = 1;
+}
+
+unsigned int Rand(Board *board) {
+	unsigned int x = board->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return board->rand_state = x;
+}
+
+ErrorCode RandFoodLocation(Board *board) {
+	/* there's never any FOOD on the board when we get here, so if there are
+	no EMPTY cells left the board is full */
 	Point p;
-	do {
-		get_random_bytes(&p.x,sizeof(int));
-		get_random_bytes(&p.y,sizeof(int));
-		p.x = p.x < 0? -p.x : p.x;
-		p.y = p.y < 0? -p.y : p.y;
-		p.x %= N;
-		p.y %= N;
-	} while (!(IsAvailable(matrix, p) || IsMatrixFull(matrix)));
-	
-	if (IsMatrixFull(matrix))
+	if (!board->free_count) {
+		board->food.x = board->food.y = -1;
 		return ERR_BOARD_FULL;
+	}
 
-	(*matrix)[p.y][p.x] = FOOD;
+	p = board->free_cells[Rand(board) % board->free_count];
+	RemoveFreeCell(board, p);
+	CELL(board,p) = FOOD;
+	SET_BIT(board->food_bits, BIT_INDEX(board,p));
+	board->food = p;
 	return ERR_OK;
 }
 
-ErrorCode Update(Matrix *matrix, Player player, Direction dir, int* hunger_counter) {
+ErrorCode Update(Board *board, Player player, Direction dir, int* hunger_counter) {
 	Point p;
-	ErrorCode e = GetInputLoc(matrix, player, &p, dir);
+	ErrorCode e = GetInputLoc(board, player, &p, dir);
 	if(e != ERR_OK) return e;
-	if (!CheckTarget(matrix, player, p)) {
+	if (!CheckTarget(board, player, p)) {
 		return ERR_ILLEGAL_MOVE;
 	}
-	e = CheckFoodAndMove(matrix, player, p, hunger_counter);
+	e = CheckFoodAndMove(board, player, p, hunger_counter);
 	if (e != ERR_OK) return e;							// Could also return ERR_BOARD_FULL. Also a tie.
-	if (IsMatrixFull(matrix)) return ERR_BOARD_FULL;	// Tie
+	if (IsMatrixFull(board)) return ERR_BOARD_FULL;	// Tie
 
 	return ERR_OK;
 }
 
-ErrorCode GetInputLoc(Matrix *matrix, Player player, Point* p, Direction dir) {
+ErrorCode GetInputLoc(Board *board, Player player, Point* p, Direction dir) {
 	if (dir != UP   && dir != DOWN && dir != LEFT && dir != RIGHT) {
 		return ERR_INVALID_MOVE;
 	}
 
-	if (GetSegment(matrix, player, p) != ERR_OK)
+	if (GetSegment(board, player, p) != ERR_OK)
 		return ERR_SEGMENT_NOT_FOUND;
 
 	switch (dir) {
@@ -121,50 +198,39 @@ ErrorCode GetInputLoc(Matrix *matrix, Player player, Point* p, Direction dir) {
 	return ERR_OK;
 }
 
-ErrorCode GetSegment(Matrix *matrix, int segment, Point* out_p) {
-	Point p;
-	/* just run through all the matrix */
-	for (p.x = 0; p.x < N; ++p.x) {
-		for (p.y = 0; p.y < N; ++p.y) {
-			if ((*matrix)[p.y][p.x] == segment) {
-				*out_p = p;
-				return ERR_OK;
-			}
+ErrorCode GetSegment(Board *board, int segment, Point* out_p) {
+	/* look the segment up in its snake */
+	int i = segment < 0 ? -segment : segment;
+	if (segment != 0) {
+		Snake *snake = GetSnake(board, segment < 0 ? BLACK : WHITE);
+		if (i <= SNAKE_SIZE(snake)) {
+			*out_p = SEGMENT(snake,i);
+			return ERR_OK;
 		}
 	}
 	out_p->x = out_p->y = -1;
 	return ERR_SEGMENT_NOT_FOUND;
 }
 
-bool CheckTarget(Matrix *matrix, Player player, Point p) {
+bool CheckTarget(Board *board, Player player, Point p) {
 	/* is empty or is the tail of the snake (so it will move the next
 	to make place) */
-	return (IsAvailable(matrix, p) || 
-			/* If it's out of bounds, don't check for the tail! */
-			(!OutOfBounds(p) && (*matrix)[p.y][p.x] == player * GetSize(matrix, player)));
+	Point p_tail = GetSnake(board, player)->segments[GetSnake(board, player)->tail];
+	return (IsAvailable(board, p) || (p.x == p_tail.x && p.y == p_tail.y));
 }
 
-int GetSize(Matrix *matrix, Player player) {
-	/* check one by one the size */
-	Point p, next_p;
-	int segment = 0;
-	while (TRUE) {
-		if (GetSegment(matrix, segment += player, &next_p) == ERR_SEGMENT_NOT_FOUND)
-			break;
-		p = next_p;
-	}
-
-	return (*matrix)[p.y][p.x] * player;
+int GetSize(Board *board, Player player) {
+	return SNAKE_SIZE(GetSnake(board, player));
 }
 
-ErrorCode CheckFoodAndMove(Matrix *matrix, Player player, Point p, int* hunger_counter) {
+ErrorCode CheckFoodAndMove(Board *board, Player player, Point p, int* hunger_counter) {
 	/* if the player did come to the place where there is food */
-	if ((*matrix)[p.y][p.x] == FOOD) {
-		*hunger_counter = K;
+	if (TEST_BIT(board->food_bits, BIT_INDEX(board,p))) {
+		*hunger_counter = board->k;
 
-		IncSizePlayer(matrix, player, p);
+		IncSizePlayer(board, player, p);
 
-		if (RandFoodLocation(matrix) != ERR_OK)
+		if (RandFoodLocation(board) != ERR_OK)
 			return ERR_BOARD_FULL;	// Tie
 	}
 	else { /* check hunger */
@@ -172,39 +238,38 @@ ErrorCode CheckFoodAndMove(Matrix *matrix, Player player, Point p, int* hunger_c
 			return ERR_SNAKE_IS_TOO_HUNGRY;
 		}
 
-		AdvancePlayer(matrix, player, p);
+		AdvancePlayer(board, player, p);
 	}
 	return ERR_OK;
 }
 
-void IncSizePlayer(Matrix *matrix, Player player, Point p) {
-	/* go from last to first so the identifier is always unique */
-	Point p_tmp;
-	int segment = GetSize(matrix, player)*player;
-	while (TRUE) {
-		GetSegment(matrix, segment, &p_tmp);
-		(*matrix)[p_tmp.y][p_tmp.x] += player;
-		segment -= player;
-		if (segment == 0)
-			break;
-	}
-	(*matrix)[p.y][p.x] = player;
+void IncSizePlayer(Board *board, Player player, Point p) {
+	/* the new head goes in the slot before the old one, the tail stays put.
+	the head was FOOD, so it was never in the free cells */
+	Snake *snake = GetSnake(board, player);
+	snake->head = PREV_SLOT(snake,snake->head);
+	snake->segments[snake->head] = p;
+	CELL(board,p) = player;
+	CLEAR_BIT(board->food_bits, BIT_INDEX(board,p));
+	SET_BIT(GetSnakeBits(board,player), BIT_INDEX(board,p));
+	++board->moves;
 }
 
-void AdvancePlayer(Matrix *matrix, Player player, Point p) {
-	/* go from last to first so the identifier is always unique */
-	Point p_tmp, p_tail;
-	GetSegment(matrix, GetSize(matrix, player) * player, &p_tail);
-	int segment = GetSize(matrix, player) * player;
-	while (TRUE) {
-		GetSegment(matrix, segment, &p_tmp);
-		(*matrix)[p_tmp.y][p_tmp.x] += player;
-		segment -= player;
-		if (segment == 0)
-			break;
-	}
-	(*matrix)[p_tail.y][p_tail.x] = EMPTY;
-	(*matrix)[p.y][p.x] = player;
+void AdvancePlayer(Board *board, Player player, Point p) {
+	/* same as above, but the tail moves up as well. free the tail first, in
+	case the head is moving into it */
+	Snake *snake = GetSnake(board, player);
+	Point p_tail = snake->segments[snake->tail];
+	CELL(board,p_tail) = EMPTY;
+	CLEAR_BIT(GetSnakeBits(board,player), BIT_INDEX(board,p_tail));
+	AddFreeCell(board, p_tail);
+	snake->tail = PREV_SLOT(snake,snake->tail);
+	snake->head = PREV_SLOT(snake,snake->head);
+	snake->segments[snake->head] = p;
+	CELL(board,p) = player;
+	SET_BIT(GetSnakeBits(board,player), BIT_INDEX(board,p));
+	RemoveFreeCell(board, p);
+	++board->moves;
 }
 
 
@@ -231,6 +296,21 @@ typedef enum {
 	DESTROYED	// After release()
 } GameState;
 
+// Moves a player queued with SNAKE_WRITE_QUEUED, waiting for their turns (see play_queued()).
+// Every move checks the counters, so they're kept apart from the moves themselves (see
+// QueuedMoves), with the rest of what every move uses. Protected by grid_lock
+#define MOVE_QUEUE 256
+typedef struct move_queue_t {
+	int pushed;					// Moves queued so far
+	int applied;				// Moves made so far. The queue is empty when this equals pushed
+} MoveQueue;
+
+// The moves of a MoveQueue. Move i is in moves[i % MOVE_QUEUE]. Protected by grid_lock
+typedef struct queued_moves_t {
+	wait_queue_head_t drained;	// Woken when the queue empties, or the game ends
+	char moves[MOVE_QUEUE];
+} QueuedMoves;
+
 // All game-related data should be stored here.
 // This includes synchronization tools.
 // Resources are numbered to prevent deadlocks - if i<j and
@@ -239,24 +319,58 @@ typedef enum {
 // - *_player_join don't need numbers because they are locked
 //   exactly once and never signalled. In addition, all lock
 //   operations on these locks are non-blocking.
-// - *_move are locked by one player and signalled by another,
-//   so white_move is "always in locked state" as far as the
-//   white player is concerned. No point in preventing the
-//   locking of other locks. However, to simplify things,
-//   give these locks the lowest numbers.
+// - The turn isn't a lock: a writer takes it when it's free (see
+//   take_turn()) and hands it to the other player when it's done,
+//   without waiting for anything in between.
+// The state needs no lock: it's a single word, read as is and changed with cmpxchg()
+// (see set_state()), so checking it costs a move nothing. Neither does the turn.
+// Games on different CPUs must not share cache lines, so each game starts on a line of
+// its own. The fields every move uses come first, and the ones that are only used to
+// start a game or change its board start on a line of their own, after them.
 typedef struct game_t {
-	int minor;					// File's minor number
-	Matrix matrix;				// Main game grid
-	Semaphore w_player_join;	// (NO RESOURCE #) Player must lock this successfully to join as the white player
-	Semaphore b_player_join;	// (NO RESOURCE #) Player must lock this successfully to join as the black player
-	Semaphore white_move;		// (RESOURCE #0) White player must lock this to move (signalled by black player)
-	Semaphore black_move;		// (RESOURCE #1) Black player must lock this to move (signalled by white player)
-	Semaphore state_lock;		// (RESOURCE #2) Protects the game_state field
-	Semaphore grid_lock;		// (RESOURCE #3) Protects the matrix field & hunger states of the players
-	GameState state;			// The state of the game
+	// Used by every move
+	volatile int turn;			// (NO RESOURCE #) The color (as SNAKE_GET_COLOR) whose turn it is, 0 while a writer has it
+	volatile GameState state;	// The state of the game. Only changes with cmpxchg(), see set_state()
+	struct rw_semaphore grid_lock;	// (RESOURCE #0) Protects the board field & hunger states of the players.
+								// Readers share it, only changes to the board (moves, SET_BOARD) need it exclusively
+	Board board;				// Main game grid, and where the snakes are on it
 	int white_hunger;			// These two are protected by grid_lock (used in the original snake game functions)
 	int black_hunger;
-} Game;
+	struct snake_snapshot* snap;	// What mmap() shows, followed by board.matrix. Written under grid_lock, see snapshot_begin()
+	struct snake_event* log;	// The last SNAKE_EVENT_LOG events, for SNAKE_READ_EVENTS. Protected by grid_lock
+	int events;					// Events logged so far. Event i is in log[i % SNAKE_EVENT_LOG]
+	int logged_winner;			// The winner as of the last event, so state changes are logged once
+	wait_queue_head_t white_turn;	// White writers wait here for their turn (see take_turn())
+	wait_queue_head_t black_turn;	// Black writers wait here for their turn
+	wait_queue_head_t poll_queue;	// Woken whenever the snapshot changes: moves, state changes and release
+	char* text;					// The board as Print() renders it, BUF_SIZE(board.n) chars. Protected by grid_lock
+	int text_moves;				// board.moves when text was rendered, or -1 if it needs rendering
+	MoveQueue white_queue;		// Counts of the moves of SNAKE_WRITE_QUEUED writers, made for them by whoever moves before them
+	MoveQueue black_queue;
+	
+	// Used to start the game, map it or change its board
+	int minor ____cacheline_aligned;	// File's minor number
+	Semaphore w_player_join;	// (NO RESOURCE #) Player must lock this successfully to join as the white player
+	Semaphore b_player_join;	// (NO RESOURCE #) Player must lock this successfully to join as the black player
+	int snap_order;				// snap takes 2^snap_order pages
+	atomic_t snap_maps;			// Mappings of snap. The board can't be replaced while there are any
+	
+	// Used by queued moves, once there are any
+	QueuedMoves white_moves ____cacheline_aligned;	// What's in white_queue
+	QueuedMoves black_moves;
+} ____cacheline_aligned Game;
+
+// Data for each open file (in file->private_data). The minor number must come
+// first, see get_minor().
+typedef struct file_data_t {
+	int minor;					// File's minor number
+	int read_format;			// What read() shows (SNAKE_READ_*), see SNAKE_SET_READ_FORMAT
+	int write_mode;				// How write() plays (SNAKE_WRITE_*), see SNAKE_SET_WRITE_MODE
+	int next_event;				// The first event the next SNAKE_READ_EVENTS read returns
+	int read_moves;				// board.moves as of the last read, for poll()
+	Semaphore read_lock;		// (NO RESOURCE #) Reads, seeks and format changes of the file take this, so
+								// they don't move its position at once. Taken before grid_lock
+} FileData;
 
 /* ****************************
  GLOBALS & FORWARD DECLARATIONS
@@ -270,6 +384,9 @@ ssize_t our_write_B(struct file*, const char*, size_t, loff_t*);
 int our_ioctl_W(struct inode*, struct file*, unsigned int, unsigned long);
 int our_ioctl_B(struct inode*, struct file*, unsigned int, unsigned long);
 loff_t our_llseek(struct file*, loff_t, int);
+int our_mmap(struct file*, struct vm_area_struct*);
+unsigned int our_poll_W(struct file*, poll_table*);
+unsigned int our_poll_B(struct file*, poll_table*);
 
 // Module name
 #define MODULE_NAME "snake"
@@ -279,6 +396,20 @@ static int major = -1;
 static int max_games = 0;
 MODULE_PARM(max_games,"i");
 
+// Seed for food placement. If given, every run places the same food (for tests and
+// benchmarks). Otherwise (0) each game is seeded from get_random_bytes().
+static int food_seed = 0;
+MODULE_PARM(food_seed,"i");
+
+// Board dimensions every game starts with (defaults are N, M and K from hw3q1.h).
+// A game can change its own with SNAKE_SET_BOARD, before the first move.
+static int board_size = N;
+MODULE_PARM(board_size,"i");
+static int snake_size = M;
+MODULE_PARM(snake_size,"i");
+static int max_hunger = K;
+MODULE_PARM(max_hunger,"i");
+
 // Games
 static Game games[256];
 
@@ -290,6 +421,8 @@ struct file_operations fops_W = {
 	.write=		our_write_W,
 	.llseek=	our_llseek,
 	.ioctl=		our_ioctl_W,
+	.mmap=		our_mmap,
+	.poll=		our_poll_W,
 	.owner=		THIS_MODULE,
 };
 struct file_operations fops_B = {
@@ -298,7 +431,9 @@ struct file_operations fops_B = {
 	.read=		our_read,
 	.write=		our_write_B,
 	.llseek=	our_llseek,
-	.ioctl=		our_ioctl_B, 
+	.ioctl=		our_ioctl_B,
+	.mmap=		our_mmap,
+	.poll=		our_poll_B,
 	.owner=		THIS_MODULE,
 };
 
@@ -320,16 +455,96 @@ static char* stringify_state(GameState gs) {
 }
 #endif /* HW4 DEBUG */
 
+// The SNAKE_GET_WINNER value of a game state
+static int winner_of(GameState gs) {
+	switch(gs) {
+		case PRE_START:
+		case ACTIVE:
+			return -1;
+		case W_WIN:
+			return 4;
+		case B_WIN:
+			return 2;
+		case TIE:
+			return 5;
+		case DESTROYED:
+		default:
+			return -10;	// Return this error as general return value - see CHECK_DESTROYED
+	}
+}
+
+// Writes to a game's snapshot (see our_mmap()) go between snapshot_begin() and
+// snapshot_end(), which make seq odd and then even again, so readers know to retry.
+// Call both with grid_lock held for writing, which makes this the only writer.
+static void snapshot_begin(Game* game) {
+	++game->snap->seq;
+	wmb();
+}
+
+// Fills in the rest of the snapshot. The cells are the board's own, so they're up to date
+static void snapshot_end(Game* game) {
+	struct snake_snapshot* snap = game->snap;
+	Board* board = &game->board;
+	GameState gs = game->state;		// A stale state is only a retry away, see publish_state()
+	snap->size = board->n;
+	snap->cell_size = sizeof(Cell);
+	snap->moves = board->moves;
+	snap->white_length = SNAKE_SIZE(&board->white);
+	snap->black_length = SNAKE_SIZE(&board->black);
+	snap->white_hunger = game->white_hunger;
+	snap->black_hunger = game->black_hunger;
+	snap->turn = gs != ACTIVE ? 0 : game->turn;	// Once it can be taken, see set_turn()
+	snap->winner = winner_of(gs);
+	wmb();
+	++snap->seq;
+	wake_up_interruptible(&game->poll_queue);
+}
+
+// Adds an event to the game's log, overwriting the oldest one if it's full.
+// Call with grid_lock held for writing.
+static struct snake_event* log_event(Game* game, int winner) {
+	struct snake_event* ev = game->log + game->events % SNAKE_EVENT_LOG;
+	ev->number = game->events++;
+	ev->player = ev->direction = ev->ate = 0;
+	ev->winner = winner;
+	ev->food_x = game->board.food.x;
+	ev->food_y = game->board.food.y;
+	game->logged_winner = winner;
+	return ev;
+}
+
+// Logs a move, after Update(). old_length is the mover's length before it.
+// Call with grid_lock held for writing.
+static void log_move(Game* game, bool is_black, char move, int old_length, GameState next) {
+	struct snake_event* ev = log_event(game, winner_of(next));
+	ev->player = is_black ? 2 : 4;
+	ev->direction = move;
+	ev->ate = SNAKE_SIZE(is_black ? &game->board.black : &game->board.white) > old_length;
+}
+
+// Publishes the game's status after a state change, to the snapshot and (unless the
+// move that caused it was logged already) to the event log. Once the game is over, no
+// turn will come and queued moves won't be made, so every writer is woken too.
+static void publish_state(Game* game) {
+	int winner;
+	down_write(&game->grid_lock);
+	snapshot_begin(game);
+	snapshot_end(game);
+	winner = winner_of(game->state);
+	if (winner != game->logged_winner)
+		log_event(game, winner);
+	up_write(&game->grid_lock);
+	if (winner != -1) {
+		wake_up_interruptible_all(&game->white_turn);
+		wake_up_interruptible_all(&game->black_turn);
+		wake_up_interruptible(&game->white_moves.drained);
+		wake_up_interruptible(&game->black_moves.drained);
+	}
+}
+
 // Checks to see if the game is in the state sent
 static int in_state(int minor, GameState gs) {
-	Game* game = games+minor;
-	down_interruptible(&game->state_lock);
-	if (game->state == gs) {
-		up(&game->state_lock);
-		return 1;
-	}
-	up(&game->state_lock);
-	return 0;
+	return games[minor].state == gs;
 }
 
 // Checks to see if the game is in DESTROYED state
@@ -342,12 +557,12 @@ static int is_active(int minor) {
 	return in_state(minor, ACTIVE);
 }
 
-// Destroys the game (changes the state)
+// Destroys the game (changes the state). This overrides any state, so it doesn't need
+// cmpxchg(): a set_state() that comes later finds the game isn't ACTIVE, and leaves it.
 static void destroy_game(int minor) {
 	Game* game = games+minor;
-	down_interruptible(&game->state_lock);
 	game->state = DESTROYED;
-	up(&game->state_lock);
+	publish_state(game);
 }
 
 // This macro return -10 from any function if the game identified by
@@ -355,73 +570,224 @@ static void destroy_game(int minor) {
 #define CHECK_DESTROYED(minor) do { \
 		if (is_destroyed(minor)) { \
 			PRINT("GAME DESTROYED! %d RETURNING -10\n",current->pid); \
-			Game* game = games+minor; \
-			up(&game->black_move); \
-			up(&game->white_move); \
 			return -10; \
 		} \
 	} while(0)
 
 // Like the above macro, but for any non-ACTIVE state.
-// This is called via write_aux(), and we need to make sure all processes get the signal.
-// For example: two processes playing as the black player try to move while it's
-// the black player's turn. They both lock black_move. Then, the white player calls close().
-// Thus, black_move is signalled, but only one black process picks up the signal! While one
-// process exits in error from write_aux(), the other will be stuck...
-// To prevent this, signal before returning.
+// This is called via write_aux(). There's no need to signal anyone before returning: whatever
+// ended the game woke every writer waiting for a turn (see publish_state()). For example, two
+// processes playing as the black player both wait for the black player's turn, and the white
+// player calls close(). Both wake up, find the game is over, and return.
 #define ASSERT_ACTIVE(minor,moves) do { \
-		if (!is_active(minor)) { \
-			Game* game = games+minor; \
-			up(&game->black_move); \
-			up(&game->white_move); \
+		if (!is_active(minor)) \
 			return moves; \
-		} \
 	} while(0)
 
-// Used to handle invalid input.
-// If the game was active when the input was sent, make the player lose.
-#define ASSERT_VALID_MOVE(minor,move,is_black) do { \
-		if (!is_valid_move(move)) { \
-			if (is_active(minor)) \
-				set_state(minor, is_black? W_WIN : B_WIN); \
-			Game* game = games+minor; \
-			up(&game->black_move); \
-			up(&game->white_move); \
+// Used to handle invalid input (is_valid says whether the move is valid, see copy_moves()).
+// If the game was active when the input was sent, make the player lose (see set_state()).
+#define ASSERT_VALID_MOVE(minor,is_valid,is_black) do { \
+		if (!(is_valid)) { \
+			set_state(minor, is_black? W_WIN : B_WIN); \
 			return -10; \
 		} \
 	} while(0)
 
-// Invalid moves should always return error.
-static bool is_valid_move(char move) {
-	return (move == '2' || move == '4' || move == '6' || move == '8');
-}
+// Invalid moves should always return error. The valid ones are looked up in a table,
+// so a chunk of moves is checked with one load per move (see copy_moves()).
+static const bool valid_moves[256] = { ['2'] = TRUE, ['4'] = TRUE, ['6'] = TRUE, ['8'] = TRUE };
 
 // Use this to read the win state, as required for SNAKE_GET_WINNER
 static int get_winner(int minor) {
+	return winner_of(games[minor].state);
+}
+
+// Board dimensions must leave room for both snakes (each on its own row) and for food
+static bool good_dimensions(int n, int m, int k) {
+	return n >= 2 && n <= MAX_N && m >= 1 && m <= n && 2*m < n*n && k >= 1;
+}
+
+// Allocates the arrays for an n x n board, and initializes it with the given dimensions.
+// The cells go in matrix (n*n of them), which belongs to the caller so it can share them.
+// Arrays the board had before are freed, and the food generator carries on where it was.
+// Returns 0, or a negative error code.
+static int alloc_board(Board* board, int n, int m, int k, Cell* matrix) {
+	char* mem;
+	if (!good_dimensions(n,m,k))
+		return -EINVAL;
+	mem = vmalloc(BOARD_MEM_SIZE(n) - n*n*sizeof(Cell));
+	if (!mem)
+		return -ENOMEM;
+	if (board->free_cells)
+		vfree(board->free_cells);
+	board->n = n;
+	board->m = m;
+	board->k = k;
+	// Widest types first, so every array is aligned
+	board->free_cells = (Point*)mem;	// Start of the block, see free_board()
+	board->white.segments = board->free_cells + n*n;
+	board->black.segments = board->white.segments + n*n;
+	board->white_bits = (BitWord*)(board->black.segments + n*n);
+	board->black_bits = board->white_bits + BIT_WORDS(n);
+	board->food_bits = board->black_bits + BIT_WORDS(n);
+	board->free_slot = (CellIndex*)(board->food_bits + BIT_WORDS(n));
+	board->matrix = matrix;
+	Init(board);					// Can't fail, there's always room for food
+	return 0;
+}
+
+static void free_board(Board* board) {
+	if (board->free_cells)
+		vfree(board->free_cells);
+	board->free_cells = NULL;
+	board->matrix = NULL;
+}
+
+// The snapshot takes whole pages, so they can be mapped. They're marked reserved, as
+// remap_page_range() only maps reserved pages of RAM.
+static struct snake_snapshot* alloc_snapshot(int size, int* order) {
+	char *snap, *page;
+	*order = get_order(size);
+	snap = (char*)__get_free_pages(GFP_KERNEL, *order);
+	if (!snap)
+		return NULL;
+	memset(snap, 0, PAGE_SIZE << *order);
+	for (page = snap; page < snap + (PAGE_SIZE << *order); page += PAGE_SIZE)
+		mem_map_reserve(virt_to_page(page));
+	return (struct snake_snapshot*)snap;
+}
+
+static void free_snapshot(struct snake_snapshot* snap, int order) {
+	char* page;
+	for (page = (char*)snap; page < (char*)snap + (PAGE_SIZE << order); page += PAGE_SIZE)
+		mem_map_unreserve(virt_to_page(page));
+	free_pages((unsigned long)snap, order);
+}
+
+// Allocates a game's board (see alloc_board()), the text cache our_read() uses and the
+// snapshot our_mmap() shows, which holds the board's cells. Both snakes start out fed. Call with grid_lock held
+// for writing (or before anyone can use the game). On failure the game keeps its old board.
+static int alloc_game_board(Game* game, int n, int m, int k) {
+	char* text;
+	struct snake_snapshot* snap;
+	int order, ret;
+	if (!good_dimensions(n,m,k))
+		return -EINVAL;
+	text = vmalloc(BUF_SIZE(n));
+	if (!text)
+		return -ENOMEM;
+	snap = alloc_snapshot(sizeof(*snap) + n*n*sizeof(Cell), &order);
+	if (!snap) {
+		vfree(text);
+		return -ENOMEM;
+	}
+	ret = alloc_board(&game->board, n, m, k, (Cell*)SNAKE_CELLS(snap));
+	if (ret) {
+		vfree(text);
+		free_snapshot(snap, order);
+		return ret;
+	}
+	if (game->text)
+		vfree(game->text);
+	game->text = text;
+	game->text_moves = -1;
+	game->white_hunger = game->black_hunger = k;
+	if (game->snap)
+		free_snapshot(game->snap, game->snap_order);
+	game->snap = snap;
+	game->snap_order = order;
+	snapshot_begin(game);
+	snapshot_end(game);
+	return 0;
+}
+
+// Frees everything allocated for a game (the event log too)
+static void free_game_board(Game* game) {
+	if (game->log)
+		kfree(game->log);
+	game->log = NULL;
+	free_board(&game->board);
+	if (game->text)
+		vfree(game->text);
+	game->text = NULL;
+	if (game->snap)
+		free_snapshot(game->snap, game->snap_order);
+	game->snap = NULL;
+}
+
+// Use this for SNAKE_SET_BOARD. The board is set up from scratch, so this is
+// only allowed before the first move.
+static int set_board(int minor, struct snake_board* arg) {
+	struct snake_board dims;
 	int ret;
 	Game* game = games+minor;
-	down_interruptible(&game->state_lock);
-	switch(game->state) {
-		case PRE_START:
-		case ACTIVE:
-			ret = -1;
-			break;
-		case W_WIN:
-			ret = 4;
-			break;
-		case B_WIN:
-			ret = 2;
+	if (copy_from_user(&dims, arg, sizeof(dims)))
+		return -EFAULT;
+	if (!is_active(minor))
+		return -EBUSY;
+	down_write(&game->grid_lock);
+	if (game->board.moves || atomic_read(&game->snap_maps))
+		ret = -EBUSY;
+	else
+		ret = alloc_game_board(game, dims.size, dims.snake_size, dims.hunger);
+	up_write(&game->grid_lock);
+	return ret;
+}
+
+// Use this for SNAKE_GET_BOARD
+static int get_board(int minor, struct snake_board* arg) {
+	struct snake_board dims;
+	Game* game = games+minor;
+	down_read(&game->grid_lock);
+	dims.size = game->board.n;
+	dims.snake_size = game->board.m;
+	dims.hunger = game->board.k;
+	up_read(&game->grid_lock);
+	return copy_to_user(arg, &dims, sizeof(dims)) ? -EFAULT : 0;
+}
+
+// Whether a SNAKE_WAIT is over. The game's own fields are checked, not the snapshot's:
+// SNAKE_SET_BOARD may free the snapshot meanwhile.
+static bool done_waiting(Game* game, bool is_black, int moves) {
+	return game->turn == (is_black ? 2 : 4) || (moves >= 0 && game->board.moves > moves) ||
+			winner_of(game->state) != -1;
+}
+
+// Use this for SNAKE_WAIT. Sleeps on the same queue as poll(), which every move and state
+// change wakes. The fields it checks are single words, so they're checked without locks
+// (grid_lock would change the task's state, and we'd never sleep).
+static int wait_for_game(int minor, bool is_black, struct snake_wait* arg) {
+	struct snake_wait w;
+	long timeout;
+	int ret = 0;
+	Game* game = games+minor;
+	DECLARE_WAITQUEUE(wait, current);
+	if (copy_from_user(&w, arg, sizeof(w)))
+		return -EFAULT;
+	if (w.timeout < 0 || w.timeout >= (MAX_SCHEDULE_TIMEOUT-999)/HZ)	// Forever, or too long to count in jiffies
+		timeout = MAX_SCHEDULE_TIMEOUT;
+	else
+		timeout = ((long)w.timeout*HZ + 999) / 1000;
+	add_wait_queue(&game->poll_queue, &wait);
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);	// Before checking, so a wake up isn't missed
+		if (done_waiting(game, is_black, w.moves))
 			break;
-		case TIE:
-			ret = 5;
+		if (!timeout) {
+			ret = -ETIMEDOUT;
 			break;
-		case DESTROYED:
-		default:
-			ret = -10;	// Return this error as general return value - see CHECK_DESTROYED
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
 			break;
+		}
+		timeout = schedule_timeout(timeout);
 	}
-	up(&game->state_lock);
-	return ret;
+	set_current_state(TASK_RUNNING);
+	remove_wait_queue(&game->poll_queue, &wait);
+	if (ret)
+		return ret;
+	return game->state == DESTROYED ? -10 : game->board.moves;	// -10 if released, see CHECK_DESTROYED
 }
 
 // Gets the minor number from a given file pointer
@@ -429,12 +795,106 @@ static int get_minor(struct file *filp) {
 	return *((int*)filp->private_data);
 }
 
-// Updates the state of the game
+// Gets the data of an open file
+static FileData* get_file_data(struct file *filp) {
+	return (FileData*)filp->private_data;
+}
+
+// The size of what read() shows (a "frame") in the file's read format. Call with grid_lock held
+// (for reading is enough)
+static int frame_size(struct file *filp, Game* game) {
+	if (get_file_data(filp)->read_format == SNAKE_READ_EVENTS)
+		return 0;		// No frame, see read_events()
+	if (get_file_data(filp)->read_format == SNAKE_READ_BINARY)
+		return SNAKE_SNAPSHOT_SIZE(game->board.n, sizeof(Cell));
+	return BUF_SIZE(game->board.n);
+}
+
+// Waits for the player's turn to write, and takes it, so other writers of the same color
+// keep waiting. A move hands the turn to the other player with set_turn(), and wake_turn() wakes
+// only that player's writers, and only one of them: they wait exclusively, as only one can take
+// the turn. Everyone is woken only when the game ends (see publish_state()).
+// Returns 0 once the turn is taken or the game is over (no turn will come, so check which),
+// or -EINTR if a signal came first. With nonblock, it doesn't wait, and returns -EAGAIN
+// if the turn can't be taken right away.
+static int take_turn(Game* game, bool is_black, bool nonblock) {
+	int mine = is_black ? 2 : 4, ret = 0;
+	wait_queue_head_t* q = is_black ? &game->black_turn : &game->white_turn;
+	DECLARE_WAITQUEUE(wait, current);
+	if (cmpxchg(&game->turn, mine, 0) == mine)		// It's free, don't bother with the queue
+		return 0;
+	if (nonblock)
+		return game->state != ACTIVE ? 0 : -EAGAIN;
+	add_wait_queue_exclusive(q, &wait);
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);	// Before checking, so a wake up isn't missed
+		if (game->state != ACTIVE || cmpxchg(&game->turn, mine, 0) == mine)
+			break;
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		schedule();
+	}
+	set_current_state(TASK_RUNNING);
+	remove_wait_queue(q, &wait);
+	if (ret && game->turn == mine)		// We may have been the one woken for it, pass it on
+		wake_up_interruptible(q);
+	return ret;
+}
+
+// Hands the turn to a player. The snapshot shows the turn only now, so poll() and SNAKE_WAIT
+// never report a turn that can't be taken yet. Call with grid_lock held for writing, and
+// wake_turn() once it's released.
+static void set_turn(Game* game, bool is_black) {
+	snapshot_begin(game);
+	game->turn = is_black ? 2 : 4;
+	snapshot_end(game);
+}
+
+// Wakes one of a player's writers, after set_turn()
+static void wake_turn(Game* game, bool is_black) {
+	wake_up_interruptible(is_black ? &game->black_turn : &game->white_turn);
+}
+
+// Hands the turn to a player and wakes one of its writers, for callers that don't hold
+// grid_lock (our_open()). Moves use set_turn() and wake_turn(), see play_queued().
+static void give_turn(Game* game, bool is_black) {
+	down_write(&game->grid_lock);
+	set_turn(game, is_black);
+	up_write(&game->grid_lock);
+	wake_turn(game, is_black);
+}
+
+// Use this for SNAKE_SET_WRITE_MODE
+static int set_write_mode(struct file *filp, unsigned long mode) {
+	if (mode != SNAKE_WRITE_TURNS && mode != SNAKE_WRITE_QUEUED)
+		return -EINVAL;
+	get_file_data(filp)->write_mode = mode;
+	return 0;
+}
+
+// Use this for SNAKE_SET_READ_FORMAT. f_pos starts over, as the frame has changed. Both
+// change under the file's read_lock, so a read sees one format and its own position
+static int set_read_format(struct file *filp, unsigned long format) {
+	FileData* data = get_file_data(filp);
+	if (format != SNAKE_READ_TEXT && format != SNAKE_READ_BINARY && format != SNAKE_READ_EVENTS)
+		return -EINVAL;
+	if (down_interruptible(&data->read_lock))
+		return -EINTR;
+	data->read_format = format;
+	filp->f_pos = 0;
+	up(&data->read_lock);
+	return 0;
+}
+
+// Ends an ACTIVE game with the given result. cmpxchg() makes the change only if the game
+// is still ACTIVE, so the first result sticks, and neither a release nor a result that came
+// first is overwritten.
 static void set_state(int minor, GameState state) {
 	Game* game = games+minor;
-	down_interruptible(&game->state_lock);
-	game->state = state;
-	up(&game->state_lock);
+	if (cmpxchg(&game->state, ACTIVE, state) == ACTIVE)
+		publish_state(game);
 }
 
 /* ****************************
@@ -442,7 +902,7 @@ static void set_state(int minor, GameState state) {
  *****************************/
 
 // Use this to simplify the ioctl() functions
-static int our_ioctl_aux(struct inode* i, bool is_black, int cmd) {
+static int our_ioctl_aux(struct inode* i, struct file* filp, bool is_black, int cmd, unsigned long arg) {
 	int minor = MINOR(i->i_rdev);	// Get minor
 	CHECK_DESTROYED(minor);			// Make sure the game wasn't released
 	switch(cmd) {
@@ -450,11 +910,225 @@ static int our_ioctl_aux(struct inode* i, bool is_black, int cmd) {
 		return get_winner(minor);
 	case SNAKE_GET_COLOR:
 		return is_black ? 2 : 4;
+	case SNAKE_SET_READ_FORMAT:
+		return set_read_format(filp, arg);
+	case SNAKE_SET_WRITE_MODE:
+		return set_write_mode(filp, arg);
+	case SNAKE_SET_BOARD:
+		return set_board(minor, (struct snake_board*)arg);
+	case SNAKE_GET_BOARD:
+		return get_board(minor, (struct snake_board*)arg);
+	case SNAKE_WAIT:
+		return wait_for_game(minor, is_black, (struct snake_wait*)arg);
 	default:
 		return -ENOTTY;
 	}
 }
 
+// The state of the game after a move, by what Update() returned
+static GameState state_after(ErrorCode e, bool is_black) {
+	switch(e) {
+	// OK: Nothing to do
+	case ERR_OK:
+		return ACTIVE;
+	// Board full: The move was legal and the board is now full! It's a tie
+	case ERR_BOARD_FULL:
+		return TIE;
+	// The rest of the states are loss states
+	case ERR_SNAKE_IS_TOO_HUNGRY:
+	case ERR_ILLEGAL_MOVE:
+	case ERR_INVALID_MOVE:	// This shouldn't happen, we've checked...
+	case ERR_SEGMENT_NOT_FOUND:
+	default:
+		return is_black ? W_WIN : B_WIN;
+	}
+}
+
+// write() copies moves from the user this many at a time
+#define MOVE_CHUNK 64
+
+// Copies the next chunk of moves (up to MOVE_CHUNK of the n left) from the user, and
+// checks them. Returns the number of moves copied, which is 0 if none could be, and sets
+// *valid to the number of valid moves before the first invalid one (all of them, if none is).
+// This way write() knows where an invalid move is before it waits for any turn.
+static int copy_moves(char* moves, const char* buf, size_t n, int* valid) {
+	int i, chunk = n < MOVE_CHUNK ? n : MOVE_CHUNK;
+	chunk -= copy_from_user(moves, buf, chunk);
+	for (i=0; i<chunk && valid_moves[(unsigned char)moves[i]]; ++i)
+		;
+	*valid = i;
+	return chunk;
+}
+
+// Makes a player's move, and logs it. Call with grid_lock held for writing.
+// Returns the state of the game after the move.
+static GameState apply_move(Game* game, bool is_black, char move) {
+	snapshot_begin(game);
+	int old_length = SNAKE_SIZE(is_black ? &game->board.black : &game->board.white);
+	ErrorCode e = Update(
+						&game->board,
+						is_black ? BLACK : WHITE,
+						(int)(move-'0'),
+						is_black? &game->black_hunger : &game->white_hunger
+					);
+	PRINT("%s player's move '%c', Update() returned %d\n",is_black? "Black":"White",move,e);
+	PRINT_IF(CountFreeCells(&game->board) != game->board.free_count,"Free cells bitmap count %d, free list %d\n",CountFreeCells(&game->board),game->board.free_count);
+	snapshot_end(game);
+	GameState next = state_after(e, is_black);
+	log_move(game, is_black, move, old_length, next);
+	return next;
+}
+
+// After a move, makes the queued moves of the player to move (*is_black) for them, and
+// the queued moves of their rival after each one, for as long as the player to move has
+// any. This way a SNAKE_WRITE_QUEUED writer doesn't wake up to move. If the game is still
+// on, the turn is handed to the player to move in the same critical section, see end_turn().
+// Call with grid_lock held for writing, with next the state the last move left.
+// Returns the state of the game, and leaves the player to move in *is_black.
+static GameState play_queued(Game* game, bool* is_black, GameState next) {
+	MoveQueue* q = *is_black ? &game->black_queue : &game->white_queue;
+	while (next == ACTIVE && game->state == ACTIVE && q->applied != q->pushed) {
+		QueuedMoves* m = *is_black ? &game->black_moves : &game->white_moves;
+		next = apply_move(game, *is_black, m->moves[q->applied % MOVE_QUEUE]);
+		if (++q->applied == q->pushed)
+			wake_up_interruptible(&m->drained);
+		*is_black = !*is_black;
+		q = *is_black ? &game->black_queue : &game->white_queue;
+	}
+	if (next == ACTIVE)
+		set_turn(game, *is_black);
+	return next;
+}
+
+// Wakes the player to move, once play_queued() handed it the turn and grid_lock was released.
+// If the game is over, set_state() wakes both players instead, as no turn will come.
+static void end_turn(int minor, bool is_black, GameState next) {
+	if (next != ACTIVE)
+		set_state(minor, next);
+	else
+		wake_turn(games+minor, is_black);
+}
+
+// Takes a writer's queued moves (start...*end-1) that weren't made yet out of the queue, and
+// returns how many were taken. Call with grid_lock held for writing.
+static int unqueue_moves(Game* game, bool is_black, int start, int* end) {
+	MoveQueue* q = is_black ? &game->black_queue : &game->white_queue;
+	int first = q->applied > start ? q->applied : start, taken;
+	if (q->pushed != *end)		// Ours were all made, and someone queued after them
+		return 0;
+	taken = *end - first;
+	q->pushed = *end = first;
+	// Writers waiting to queue theirs
+	wake_up_interruptible(is_black ? &game->black_moves.drained : &game->white_moves.drained);
+	return taken;
+}
+
+/**
+ * Use this for SNAKE_WRITE_QUEUED writes.
+ *
+ * The moves are copied a chunk at a time and queued for as long as there's room, and the
+ * writer only sleeps once the queue is full or all its moves are queued, until they were
+ * played (see play_queued()) or the game is over. If it's the writer's turn already, no one
+ * is going to move before it, so it takes the turn and starts playing itself.
+ * Only one writer's moves are queued at a time, so a writer whose queue holds someone
+ * else's moves waits for them to be made first.
+ * An invalid move isn't queued. Once the moves before it were made, the player loses on
+ * its next turn (if the game is still on) and write() fails, as in a regular write().
+ * A signal takes back the writer's moves that weren't made yet, so write() returns how many
+ * were made, and no more are made for it after that.
+ */
+static ssize_t write_queued(struct file *filp, const char *buf, size_t n, bool is_black) {
+	int minor = get_minor(filp);
+	Game* game = games+minor;
+	MoveQueue* q = is_black ? &game->black_queue : &game->white_queue;
+	QueuedMoves* m = is_black ? &game->black_moves : &game->white_moves;
+	char moves[MOVE_CHUNK];
+	int copied = 0, chunk = 0, used = 0, valid = 0, queued = 0, start = 0, end = 0, room, done, ret = 0;
+	bool my_turn;
+	for (;;) {
+		
+		// Get the next chunk once this one is queued, and where the first invalid move in it is
+		if (used == chunk && copied < n) {
+			chunk = copy_moves(moves, buf+copied, n-copied, &valid);
+			if (!chunk && !copied)
+				return -EFAULT;
+			if (!chunk)
+				n = copied;			// The rest can't be copied, so the input ends here
+			copied += chunk;
+			used = 0;
+		}
+		
+		// Queue as many of the valid moves as there's room for. Our moves are start...end-1,
+		// and once the queue is empty they were all made
+		down_write(&game->grid_lock);
+		if (game->state != ACTIVE) {
+			up_write(&game->grid_lock);
+			break;
+		}
+		if (q->applied == q->pushed)
+			start = end = q->pushed;
+		my_turn = FALSE;
+		if (q->pushed == end) {		// Otherwise the queue holds someone else's moves
+			my_turn = q->applied == q->pushed && used < valid && game->board.moves % 2 == is_black;
+			for (room = MOVE_QUEUE - (q->pushed - q->applied); room && used < valid; --room, ++queued)
+				m->moves[q->pushed++ % MOVE_QUEUE] = moves[used++];
+			end = q->pushed;
+		}
+		up_write(&game->grid_lock);
+		
+		// No one makes the first move for us if it's our turn already
+		if (my_turn) {
+			ret = take_turn(game, is_black, FALSE);
+			if (ret) {
+				// The turn stays ours with no one to take it, so take the moves back
+				down_write(&game->grid_lock);
+				queued -= unqueue_moves(game, is_black, start, &end);
+				up_write(&game->grid_lock);
+				break;
+			}
+			if (game->state != ACTIVE)
+				break;
+			bool to_move = is_black;
+			down_write(&game->grid_lock);
+			GameState next = play_queued(game, &to_move, ACTIVE);
+			up_write(&game->grid_lock);
+			end_turn(minor, to_move, next);
+		}
+		
+		// Keep queueing while there's room and input. Otherwise, wait for the queue to drain
+		if (used == chunk && copied < n)
+			continue;
+		ret = wait_event_interruptible(m->drained, q->applied == q->pushed || game->state != ACTIVE);
+		if (ret) {
+			down_write(&game->grid_lock);
+			queued -= unqueue_moves(game, is_black, start, &end);
+			up_write(&game->grid_lock);
+			break;
+		}
+		if (game->state != ACTIVE)
+			break;
+		if (used < valid)		// There's room for the rest now
+			continue;
+		
+		// The moves before an invalid one were made. It loses on our turn, as in a regular write()
+		if (valid < chunk) {
+			ret = take_turn(game, is_black, FALSE);
+			if (ret)
+				break;
+			CHECK_DESTROYED(minor);
+			ASSERT_VALID_MOVE(minor, FALSE, is_black);
+		}
+		break;
+	}
+	CHECK_DESTROYED(minor);
+	
+	// Count the moves made, out of the ones queued. Those before start were made already
+	done = q->applied - start;
+	done = done < 0 ? 0 : done > end - start ? end - start : done;
+	queued -= end - start - done;
+	return queued || !ret ? queued : -EINTR;
+}
+
 /**
  * Use this to simplify the write() functions.
  *
@@ -463,6 +1137,8 @@ static int our_ioctl_aux(struct inode* i, bool is_black, int cmd) {
  *   of moves successfully written (moved).
  * - If the input is an illegal character (even if it came after some legal ones) return in error.
  * - If the input is illegal AND the game is over/destroyed, return in error.
+ * - If the file is non-blocking (O_NONBLOCK), make the moves for as long as it's our turn
+ *   right away, and return the number made, or EAGAIN if not even one was.
  */
 static ssize_t our_write_aux(struct file *filp, const char *buf, size_t n, loff_t *f_pos, bool is_black) {
 	
@@ -477,22 +1153,41 @@ static ssize_t our_write_aux(struct file *filp, const char *buf, size_t n, loff_
 	// If the buffer is NULL, return EFAULT (Piazza 429)
 	if (!buf) return -EFAULT;
 	
-	// Get the moves.
-	char moves[n];
-	int ret = copy_from_user(moves,buf,n);
+	// Queued moves are made for the writer, see write_queued()
+	if (get_file_data(filp)->write_mode == SNAKE_WRITE_QUEUED)
+		return write_queued(filp, buf, n, is_black);
+	
+	// Get the moves. They're copied MOVE_CHUNK at a time, so the stack doesn't grow
+	// with n, and moves[] always holds moves chunk_start...chunk_start+chunk-1.
+	// The first valid ones of them are checked already (see copy_moves()).
+	char moves[MOVE_CHUNK];
+	int chunk_start = 0, valid;
+	int chunk = copy_moves(moves, buf, n, &valid);
 	
 	// If NOTHING was copied successfully, return in error.
-	if (ret == n) return -EFAULT;
+	if (!chunk) return -EFAULT;
 	
-	// Otherwise, perform (n-ret) moves (ret is the amount NOT copied, so n-ret WERE copied).
+	// Otherwise, perform the moves until one can't be copied (copy_moves() returns 0).
 	int current_move;
 	Game* game = games+minor;
-	for (current_move=0; current_move<n-ret; ++current_move) {
+	for (current_move=0; current_move<n; ++current_move) {
+		
+		// Get the next chunk of moves, if this one is done
+		if (current_move == chunk_start+chunk) {
+			chunk_start = current_move;
+			chunk = copy_moves(moves, buf+current_move, n-current_move, &valid);
+			if (!chunk)
+				break;
+		}
+		char move = moves[current_move-chunk_start];
 		
-		PRINT("In write with %s player (pid %d), move #%d is '%c'. Waiting for signal...\n",is_black? "Black":"White",current->pid,current_move+1,moves[current_move]);
+		PRINT("In write with %s player (pid %d), move #%d is '%c'. Waiting for signal...\n",is_black? "Black":"White",current->pid,current_move+1,move);
 		
-		// Wait for our turn
-		down_interruptible(is_black? &game->black_move : &game->white_move);
+		// Wait for our turn. If a signal comes first, or the file is non-blocking and it isn't
+		// our turn (any more), return what was moved so far
+		int ret = take_turn(game, is_black, (filp->f_flags & O_NONBLOCK) != 0);
+		if (ret)
+			return current_move ? current_move : ret;
 		
 		PRINT("In write with %s player, move #%d, locked the move lock\n",is_black? "Black":"White",current_move+1);
 		
@@ -506,51 +1201,24 @@ static ssize_t our_write_aux(struct file *filp, const char *buf, size_t n, loff_
 		
 		// If this is an illegal move, return in error.
 		// This should happen BEFORE testing if the game is active!
-		ASSERT_VALID_MOVE(minor,moves[current_move],is_black);
+		ASSERT_VALID_MOVE(minor,current_move-chunk_start < valid,is_black);
 		
 		// If the game is over, return NOW with the number of written moves.
 		ASSERT_ACTIVE(minor, current_move);
 		
-		// Lock the grid and try to move.
-		// What happens next depends on the error code
-		down_interruptible(&game->grid_lock);
-		ErrorCode e = Update(
-							&game->matrix,
-							is_black ? BLACK : WHITE,
-							(int)(moves[current_move]-'0'),
-							is_black? &game->black_hunger : &game->white_hunger
-						);
-		up(&game->grid_lock);
-		
-		PRINT("In write with %s player, move #%d, update return value is %d\n",is_black? "Black":"White",current_move+1,e);
+		// Lock the grid (exclusively, readers must not see half a move) and try to move.
+		// Then make the other player's queued moves, if there are any (and ours after
+		// them, if there are any of those).
+		down_write(&game->grid_lock);
+		GameState next = apply_move(game, is_black, move);
+		bool to_move = !is_black;
+		next = play_queued(game, &to_move, next);
+		up_write(&game->grid_lock);
 		
-		switch(e) {
-		// OK: Nothing to do
-		case ERR_OK: break;
-		// Board full: The move was legal and the board is now full! It's a tie
-		case ERR_BOARD_FULL: 
-			set_state(minor,TIE);
-			break;
-		// The rest of the states are loss states
-		case ERR_SNAKE_IS_TOO_HUNGRY:
-		case ERR_ILLEGAL_MOVE:
-		case ERR_INVALID_MOVE:	// This shouldn't happen, we've checked...
-		case ERR_SEGMENT_NOT_FOUND:
-			set_state(minor, is_black ? W_WIN : B_WIN);
-			break;
-		}
-
 		PRINT("%s player signalling...\n",is_black? "Black":"White");
 		
-		// Anyway, if the error code wasn't ERR_OK, the game is over so we can release both players.
-		if (e != ERR_OK) {
-			up(&game->black_move);
-			up(&game->white_move);
-		}
-		else {
-			// Signal the other player it's her turn
-			up(is_black ? &game->white_move : &game->black_move);\
-		}
+		// Signal the player whose turn it is, or both if the game is over
+		end_turn(minor, to_move, next);
 		
 	}
 	
@@ -559,6 +1227,28 @@ static ssize_t our_write_aux(struct file *filp, const char *buf, size_t n, loff_
 	
 }
 
+// Use this to simplify the poll() functions. The game's snapshot and move count have
+// everything needed, and they're consistent while grid_lock is held for reading. The board
+// only changes with a move, so the move count tells whether it did: the snapshot's seq also
+// changes when the turn or the state does.
+static unsigned int our_poll_aux(struct file *filp, poll_table *wait, bool is_black) {
+	FileData* data = get_file_data(filp);
+	Game* game = games+data->minor;
+	unsigned int mask = 0;
+	poll_wait(filp, &game->poll_queue, wait);
+	down_read(&game->grid_lock);
+	if (game->snap->winner == -10)						// Released
+		mask |= POLLHUP;
+	else if (game->snap->turn == (is_black ? 2 : 4))	// My turn
+		mask |= POLLOUT | POLLWRNORM;
+	if (data->read_format == SNAKE_READ_EVENTS ?
+			data->next_event < game->events :			// Something happened
+			data->read_moves != game->board.moves)		// The board changed since my last read
+		mask |= POLLIN | POLLRDNORM;
+	up_read(&game->grid_lock);
+	return mask;
+}
+
 /* ****************************
  FOPS FUNCTIONS
  *****************************/
@@ -592,37 +1282,43 @@ int our_open(struct inode* i, struct file* filp) {
 	Game* game = games+minor;
 	
 	// If the game isn't willing to accept new players, exit in error
-	down_interruptible(&game->state_lock);
-	if (game->state != PRE_START) {
-		up(&game->state_lock);
+	if (game->state != PRE_START)
 		return -ENOSPC;
-	}
-	up(&game->state_lock);
+	
+	// Set up the file's data, before there's a game to back out of
+	FileData* data = kmalloc(sizeof(FileData), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	data->minor = minor;
+	data->read_format = SNAKE_READ_TEXT;
+	data->write_mode = SNAKE_WRITE_TURNS;
+	data->next_event = 0;
+	data->read_moves = -1;	// Never a move count, so the board is new to the file
+	sema_init(&data->read_lock, 1);
 	
 	// Try to join the game
 	if (down_trylock(&game->w_player_join)) {		// If player 1 is already in-game
 		if (down_trylock(&game->b_player_join)) {	// ...and so is player 2
 			// "No space left on the device". This should happen only if player 2 joined but
-			// didn't lock game_state_locks[minor] yet.
+			// didn't start the game yet.
+			kfree(data);
 			return -ENOSPC;							
 		}
 		// I am player 2
 		else {
 			filp->f_op = &fops_B;						// Switch the writing function (so it knows I'm player 2)
-			filp->private_data = (void*)&game->minor;	// Save the minor number for later use
-			down_interruptible(&game->state_lock);		// Update game state
-			game->state = ACTIVE;
-			up(&game->state_lock);
-			up(&game->white_move);						// Tell player 1 we're good to go! He can move
+			filp->private_data = (void*)data;			// Save the minor number (and more) for later use
+			if (cmpxchg(&game->state, PRE_START, ACTIVE) == PRE_START)	// Start the game, unless it was released
+				publish_state(game);
+			give_turn(game, FALSE);						// Tell player 1 we're good to go! He can move
 		}
 	}
 	// Else: I am player 1
 	else {
 		filp->f_op = &fops_W;						// Switch the writing function (so it knows I'm player 1)
 		game->minor = minor;						// Inform the Game structure which minor it is
-		filp->private_data = (void*)&game->minor;	// Save the minor number for later use
-		down_interruptible(&game->white_move);		// Wait for player 2 (blocking operation)
-		up(&game->white_move);						// Signal the fact that it's my turn
+		filp->private_data = (void*)data;			// Save the minor number (and more) for later use
+		wait_event_interruptible(game->white_turn, game->state != PRE_START);	// Wait for player 2 (blocking operation)
 	}
 	
 	// Done with game-starting logic
@@ -635,32 +1331,139 @@ int our_release(struct inode* i, struct file* filp) {
 	// Get minor
 	int minor = MINOR(i->i_rdev);
 	
-	// Destroy the game
-	destroy_game(minor);
-	
-	// Signal the other player, who may be waiting to move.
-	// If we don't do this, the other player may be trapped, forever
+	// Destroy the game.
+	// This signals both players (see publish_state()), who may be waiting to move.
+	// If we didn't, the other player may be trapped, forever
 	// waiting for his turn which won't come...
-	// Also signal myself. Maybe there are two processes playing as
-	// the same player, one releasing and one writing. If the writing
-	// process is waiting for it's turn, we should signal it here
-	// already...
-	PRINT("Signalling both players...\n");
-	Game* game = games+minor;
-	up(&game->white_move);
-	up(&game->black_move);
+	// It signals me too. Maybe there are two processes playing as
+	// the same player, one releasing and one writing.
+	destroy_game(minor);
 	
+	kfree(filp->private_data);
 	return 0;
 	
 }
 
+// Locks a game's grid for reading, with the text cache up to date. Rendering changes the
+// cache, so it takes grid_lock for writing, but only once per move. The board may move on
+// between the two locks, in which case the new board is rendered.
+static void lock_text(Game* game) {
+	down_read(&game->grid_lock);
+	while (game->text_moves != game->board.moves) {
+		up_read(&game->grid_lock);
+		down_write(&game->grid_lock);
+		if (game->text_moves != game->board.moves) {	// Another reader may have rendered it
+			Print(&game->board, game->text, BUF_SIZE(game->board.n));
+			game->text_moves = game->board.moves;
+		}
+		up_write(&game->grid_lock);
+		down_read(&game->grid_lock);
+	}
+}
+
+// Use this for SNAKE_READ_EVENTS reads. Copies as many whole events as fit in the
+// buffer, from the file's cursor on, and moves the cursor past them. A reader that
+// fell more than SNAKE_EVENT_LOG events behind skips to the oldest one left.
+// Returns the number of bytes copied (0 if there are no new events), or an error.
+// Once the game was released and its last event read, returns -10 (see CHECK_DESTROYED).
+// The cursor is the file's own, so the log only needs grid_lock for reading.
+static ssize_t read_events(struct file *filp, char *buf, size_t n) {
+	FileData* data = get_file_data(filp);
+	Game* game = games+data->minor;
+	int copied = 0, ret = 0;
+	if (n < sizeof(struct snake_event))
+		return -EINVAL;
+	down_read(&game->grid_lock);
+	if (data->next_event < game->events - SNAKE_EVENT_LOG)
+		data->next_event = game->events - SNAKE_EVENT_LOG;
+	if (data->next_event == game->events && game->logged_winner == -10) {	// Release was logged
+		up_read(&game->grid_lock);
+		return -10;
+	}
+	while (data->next_event < game->events && n - copied >= sizeof(struct snake_event)) {
+		if (copy_to_user(buf + copied, game->log + data->next_event % SNAKE_EVENT_LOG,
+				sizeof(struct snake_event))) {
+			ret = -EFAULT;
+			break;
+		}
+		copied += sizeof(struct snake_event);
+		++data->next_event;
+	}
+	up_read(&game->grid_lock);
+	return copied ? copied : ret;
+}
+
+// Use this for SNAKE_READ_TEXT and SNAKE_READ_BINARY reads, see our_read().
+// Call with the file's read_lock held, as this moves *f_pos.
+static ssize_t read_frame(struct file *filp, char *buf, size_t n, loff_t *f_pos) {
+	
+	// pread() can ask for any offset
+	if (*f_pos < 0) return -EINVAL;
+	
+	// Get the game and lock the grid for reading, so readers don't wait for each other.
+	// In binary format, the frame is the snapshot, which is always up to date.
+	// Otherwise, the board is only rendered again if someone moved since the last
+	// time (see lock_text()), and the text is copied straight from the cache.
+	Game* game = games+get_minor(filp);
+	char* frame;
+	if (get_file_data(filp)->read_format == SNAKE_READ_BINARY) {
+		down_read(&game->grid_lock);
+		frame = (char*)game->snap;
+	}
+	else {
+		lock_text(game);
+		frame = game->text;
+	}
+	get_file_data(filp)->read_moves = game->board.moves;
+	int size = frame_size(filp, game);
+	
+	// Copy the data to the user, from the offset. If the buffer goes past the end of the
+	// frame, leave trailing zeros. Those are written once the lock is released, so a large
+	// buffer doesn't keep the writers waiting.
+	// If it fails completely (n bytes not written), return EFAULT.
+	// Otherwise, return the number of copied bytes.
+	// As ret is the number of bytes NOT copied, return n-ret.
+	int pos = *f_pos < size ? (int)*f_pos : size;
+	int text = n < size-pos ? n : size-pos;
+	int ret = copy_to_user(buf, frame+pos, text);
+	up_read(&game->grid_lock);
+	if (n>text)
+		ret += clear_user(buf+text, n-text);
+	if (ret == n)
+		return -EFAULT;
+	
+	// Move on, and start over after the end of the frame
+	*f_pos += n-ret;
+	if (*f_pos >= size)
+		*f_pos = 0;
+	return n-ret;
+}
+
+/**
+ * Read the board, as Print() renders it, starting at *f_pos.
+ *
+ * The text is a "frame" of BUF_SIZE(n) characters. In SNAKE_READ_BINARY
+ * format the frame is the game's snapshot instead (see our_mmap()), a fixed
+ * header followed by the cells, so clients don't have to parse the text.
+ * Either way, a read always returns
+ * the n bytes asked for: the frame from *f_pos on, and zeros past its end.
+ * *f_pos moves forward by n, and back to the start once the frame has been
+ * read to the end. So reading a whole frame (or more) at once always shows
+ * the board from the top, and a large board can be streamed in pieces, or
+ * read in part with lseek() or pread().
+ *
+ * In SNAKE_READ_EVENTS format, read returns the events logged since the
+ * last read instead (see read_events()).
+ */
 ssize_t our_read(struct file *filp, char *buf, size_t n, loff_t *f_pos) {
 	
 	// Get the minor
 	int minor = get_minor(filp);
 	
-	// Check if the operation is valid
-	CHECK_DESTROYED(minor);
+	// Check if the operation is valid. Events can be read after a release, up to the
+	// release's own (see read_events())
+	if (get_file_data(filp)->read_format != SNAKE_READ_EVENTS)
+		CHECK_DESTROYED(minor);
 	
 	// If size=0, return 0 (successfully)
 	if (!n) return 0;
@@ -668,26 +1471,15 @@ ssize_t our_read(struct file *filp, char *buf, size_t n, loff_t *f_pos) {
 	// Piazza 429:
 	if (!buf) return -EFAULT;
 	
-	// Get the game and lock the grid, read the data, unlock
-	Game* game = games+minor;
-	down_interruptible(&game->grid_lock);
-	char our_buf[n];
-	Print(&game->matrix, our_buf, n);
-	up(&game->grid_lock);
-	
-	// If the buffer is too large, leave trailing zeros
-	if (n>GOOD_BUF_SIZE) {
-		int i;
-		for(i=GOOD_BUF_SIZE; i<n; ++i)
-			our_buf[i] = 0;
-	}
-	
-	// Copy the data to the user.
-	// If it fails completely (n bytes not written), return EFAULT.
-	// Otherwise, return the number of copied bytes.
-	// As ret is the number of bytes NOT copied, return n-ret.
-	int ret = copy_to_user(buf, our_buf, n);
-	return ret == n ? -EFAULT : n-ret;
+	// Reads of the same file take turns, so each one starts where the last one left the
+	// file's position. Events aren't a frame, so there's nothing to seek in
+	FileData* data = get_file_data(filp);
+	if (down_interruptible(&data->read_lock))
+		return -EINTR;
+	ssize_t ret = data->read_format == SNAKE_READ_EVENTS ?
+			read_events(filp, buf, n) : read_frame(filp, buf, n, f_pos);
+	up(&data->read_lock);
+	return ret;
 
 }
 
@@ -705,45 +1497,162 @@ ssize_t our_write_B(struct file *filp, const char *buf, size_t n, loff_t *f_pos)
 
 
 int our_ioctl_W(struct inode *i, struct file *filp, unsigned int cmd, unsigned long arg) {
-	return our_ioctl_aux(i,FALSE,cmd);
+	return our_ioctl_aux(i,filp,FALSE,cmd,arg);
 }
 
 int our_ioctl_B(struct inode *i, struct file *filp, unsigned int cmd, unsigned long arg) {
-	return our_ioctl_aux(i,TRUE,cmd);
+	return our_ioctl_aux(i,filp,TRUE,cmd,arg);
+}
+
+/**
+ * Wait for the game. POLLOUT means it's the caller's turn, POLLIN that there's
+ * something new to read (the board changed since the last read, or in
+ * SNAKE_READ_EVENTS format, there are new events) and POLLHUP that the game
+ * was released.
+ */
+unsigned int our_poll_W(struct file *filp, poll_table *wait) {
+	return our_poll_aux(filp,wait,FALSE);
+}
+unsigned int our_poll_B(struct file *filp, poll_table *wait) {
+	return our_poll_aux(filp,wait,TRUE);
 }
 
+// Seek within the frame our_read() shows. Offsets are kept within the frame, so
+// seeking from the end works as it does for a regular file.
 loff_t our_llseek(struct file *filp, loff_t x, int n) {
-	return -ENOSYS;
+	loff_t pos;
+	int size, minor = get_minor(filp);
+	Game* game = games+minor;
+	FileData* data = get_file_data(filp);
+	CHECK_DESTROYED(minor);
+	if (down_interruptible(&data->read_lock))
+		return -EINTR;
+	down_read(&game->grid_lock);
+	size = frame_size(filp, game);
+	up_read(&game->grid_lock);
+	switch (n) {
+	case 0:		// SEEK_SET
+		pos = x;
+		break;
+	case 1:		// SEEK_CUR
+		pos = filp->f_pos + x;
+		break;
+	case 2:		// SEEK_END
+		pos = size + x;
+		break;
+	default:
+		pos = -1;		// Not a whence, fails below
+	}
+	if (pos < 0 || pos > size)
+		pos = -EINVAL;
+	else
+		filp->f_pos = pos;
+	up(&data->read_lock);
+	return pos;
+}
+
+// Keeps count of a game's snapshot mappings, for set_board()
+static void snapshot_vm_open(struct vm_area_struct *vma) {
+	atomic_inc(&((Game*)vma->vm_private_data)->snap_maps);
+}
+static void snapshot_vm_close(struct vm_area_struct *vma) {
+	atomic_dec(&((Game*)vma->vm_private_data)->snap_maps);
+}
+static struct vm_operations_struct snapshot_vm_ops = {
+	.open=		snapshot_vm_open,
+	.close=		snapshot_vm_close,
+};
+
+/**
+ * Map the game's snapshot (struct snake_snapshot, followed by the board's cells)
+ * into the caller's memory. The mapping is read only and must start at offset 0.
+ * The module keeps the snapshot up to date, so spectators can watch the game
+ * without calling read(). As long as the snapshot is mapped, the board can't be
+ * changed with SNAKE_SET_BOARD.
+ */
+int our_mmap(struct file *filp, struct vm_area_struct *vma) {
+	int minor = get_minor(filp);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	Game* game = games+minor;
+	
+	// Check if the operation is valid
+	CHECK_DESTROYED(minor);
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	
+	down_read(&game->grid_lock);		// Keeps SET_BOARD from replacing the snapshot meanwhile
+	if (size > (PAGE_SIZE << game->snap_order)) {
+		up_read(&game->grid_lock);
+		return -EINVAL;
+	}
+	if (remap_page_range(vma->vm_start, virt_to_phys(game->snap), size, vma->vm_page_prot)) {
+		up_read(&game->grid_lock);
+		return -EAGAIN;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;		// No mprotect() into a writable mapping either
+	vma->vm_ops = &snapshot_vm_ops;
+	vma->vm_private_data = game;
+	snapshot_vm_open(vma);
+	up_read(&game->grid_lock);
+	return 0;
 }
 
 
 int init_module(void) {
 	
 	// Initial values, game setup and semaphore setup
-	int i;
+	int i, ret;
+	if (!good_dimensions(board_size, snake_size, max_hunger))
+		return -EINVAL;
 	for (i=0; i<max_games; ++i) {
 		
-		// Initialize the board
-		if (Init(&games[i].matrix) != ERR_OK)
-			return -EPERM;						// Should never happen...
+		// Seed the food generator
+		if (food_seed)
+			SeedRand(&games[i].board, food_seed + i);
+		else {
+			unsigned int seed;
+			get_random_bytes(&seed, sizeof(seed));
+			SeedRand(&games[i].board, seed);
+		}
+		// Allocate the event log, then allocate and initialize the board.
+		// Both snakes are healthy & happy ...BUT NOT FOR LONG
+		games[i].state = PRE_START;				// No one has called open() yet
+		games[i].events = 0;					// Nothing happened yet
+		games[i].logged_winner = -1;
+		init_waitqueue_head(&games[i].poll_queue);	// Before the board, which wakes it
+		games[i].turn = 0;						// No one's turn until the game starts
+		init_waitqueue_head(&games[i].white_turn);
+		init_waitqueue_head(&games[i].black_turn);
+		games[i].white_queue.pushed = games[i].white_queue.applied = 0;	// No moves queued
+		games[i].black_queue.pushed = games[i].black_queue.applied = 0;
+		init_waitqueue_head(&games[i].white_moves.drained);
+		init_waitqueue_head(&games[i].black_moves.drained);
+		games[i].log = kmalloc(SNAKE_EVENT_LOG*sizeof(struct snake_event), GFP_KERNEL);
+		ret = games[i].log ? alloc_game_board(games+i, board_size, snake_size, max_hunger) : -ENOMEM;
+		if (ret) {
+			free_game_board(games+i);
+			while (i--)
+				free_game_board(games+i);
+			return ret;
+		}
 		
 		// Initialize other fields
-		games[i].state = PRE_START;				// No one has called open() yet
 		games[i].minor = -1;					// No minor number yet
-		games[i].white_hunger = K;				// Both snakes are healthy & happy
-		games[i].black_hunger = K;				// ...BUT NOT FOR LONG
-		sema_init(&games[i].state_lock, 1);		// We need locks for each game
-		sema_init(&games[i].grid_lock, 1);		// Player must lock this successfully to r/w the game grid
-		sema_init(&games[i].white_move, 0);		// White player must lock this to move (signalled by black player)
-		sema_init(&games[i].black_move, 0);		// Black player must lock this to move (signalled by white player)
+		atomic_set(&games[i].snap_maps, 0);		// No one has called mmap() yet
+		init_rwsem(&games[i].grid_lock);		// Lock this for reading to read the game grid, for writing to change it
 		sema_init(&games[i].w_player_join, 1);	// Player must lock this successfully to join as the white player
 		sema_init(&games[i].b_player_join, 1);	// Player must lock this successfully to join as the black player
 	}
 	
 	// Registration
 	major = register_chrdev(0, MODULE_NAME, &fops_B);	// Make black the default. Down with racism!
-	if (major < 0)	// FAIL
+	if (major < 0) {	// FAIL
+		for (i=0; i<max_games; ++i)
+			free_game_board(games+i);
 		return major;
+	}
 	SET_MODULE_OWNER(&fops_B);
 	
 	return 0;
@@ -756,6 +1665,9 @@ void cleanup_module(void) {
 	if (unregister_chrdev(major, MODULE_NAME)<0)
 		printk("FATAL ERROR: unregister_chrdev() failed\n");
 	
+	// Free the boards
+	int i;
+	for (i=0; i<max_games; ++i)
+		free_game_board(games+i);
+	
 }
-
-
@@ -557,6 +557,53 @@ bool read_N_gt_grid_returns_N() {
 	return TRUE;
 }
 
+// Reading the grid in small pieces should give the same grid, with zeros after the end.
+// The next read starts over from the top
+bool read_in_pieces() {
+	CREATE_BUF();
+	char pieces[GOOD_BUF_SIZE+10];
+	int i, got = 0;
+	SETUP_P(1,1);
+	int fd = open(get_node_name(0),O_RDWR);
+	ASSERT(read(fd,buf,GOOD_BUF_SIZE) == GOOD_BUF_SIZE);
+	do {
+		ASSERT(read(fd,pieces+got,10) == 10);
+		got += 10;
+		ASSERT(got < GOOD_BUF_SIZE+10);
+	} while (lseek(fd,0,SEEK_CUR));			// Back to the start after the end of the grid
+	ASSERT(!strncmp(buf,pieces,GOOD_BUF_SIZE));
+	for (i=GOOD_BUF_SIZE; i<got; ++i)
+		ASSERT(pieces[i] == '\0');
+	usleep(1000);
+	close(fd);
+	DESTROY_P();
+	return TRUE;
+}
+
+// lseek() and pread() should reach any part of the grid
+bool read_seek_to_row() {
+	CREATE_BUF();
+	char row[3*N+4];
+	int row_start = 3*(N+1)+1 + (N-1)*(3*N+4);	// The black snake's row
+	SETUP_P(1,1);
+	int fd = open(get_node_name(0),O_RDWR);
+	ASSERT(read(fd,buf,GOOD_BUF_SIZE) == GOOD_BUF_SIZE);
+	ASSERT(lseek(fd,row_start,SEEK_SET) == row_start);
+	ASSERT(read(fd,row,sizeof(row)) == sizeof(row));
+	ASSERT(!strncmp(row,buf+row_start,sizeof(row)));
+	ASSERT(lseek(fd,-(3*(N+1)+1),SEEK_END) == GOOD_BUF_SIZE-(3*(N+1)+1));	// The last line
+	ASSERT(read(fd,row,3*(N+1)+1) == 3*(N+1)+1);
+	ASSERT(!strncmp(row,buf+GOOD_BUF_SIZE-(3*(N+1)+1),3*(N+1)+1));
+	ASSERT(pread(fd,row,5,row_start) == 5);
+	ASSERT(!strncmp(row,buf+row_start,5));
+	ASSERT(lseek(fd,GOOD_BUF_SIZE+1,SEEK_SET) == -1);
+	ASSERT(errno == EINVAL);
+	usleep(1000);
+	close(fd);
+	DESTROY_P();
+	return TRUE;
+}
+
 // Reading after release() should return -1 with errno=10
 bool read_after_release() {
 	CREATE_BUF();
@@ -1452,6 +1499,44 @@ bool single_write_turns() {
 	return TRUE;
 }
 
+// A multi-megabyte move string should be played in full. On the largest board the snakes
+// (1 segment each, never hungry) circle a 2x2 square and can't run into each other
+bool write_long_stream() {
+	int n = 4*1024*1024;
+	char* moves = malloc(n);
+	ASSERT(moves);
+	SETUP_OPEN_SIMPLE(TRUE);
+	ASSERT(setup_loop_game(fd,moves,n));
+	ASSERT(write(fd,moves,n) == n);
+	if (P_IS_FATHER())
+		ASSERT(ioctl(fd,SNAKE_GET_WINNER) == -1);
+	else usleep(10000);		// Black moves last, don't close the game on it
+	free(moves);
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// In SNAKE_WRITE_QUEUED mode the white player's moves are made for it as black moves,
+// and an invalid move still loses, once the moves before it were made
+bool write_queued() {
+	int n = 1000;
+	char moves[1001];
+	SETUP_OPEN_SIMPLE(TRUE);
+	ASSERT(setup_loop_game(fd,moves,n));
+	if (P_IS_FATHER()) {
+		ASSERT(!ioctl(fd,SNAKE_SET_WRITE_MODE,SNAKE_WRITE_QUEUED));
+		moves[n] = 'x';
+		ASSERT(write(fd,moves,n+1) == -1);
+		ASSERT(ioctl(fd,SNAKE_GET_WINNER) == BLACK_COLOR);
+	}
+	else {
+		ASSERT(write(fd,moves,n) == n);
+		usleep(10000);
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
 // Multiple games, bulk write operations - make sure they're turn-based.
 bool bulk_write_turns() {
 	int i, tries=30;
@@ -1554,6 +1639,48 @@ bool invalid_move_loses() {
 	return TRUE;
 }
 
+// A non-blocking write() makes the moves it can without waiting, and fails with EAGAIN if it
+// isn't the caller's turn
+bool write_nonblock() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	struct snake_wait wait = {-1, 2000};
+	if (P_IS_FATHER()) {
+		ASSERT(!fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK));
+		ASSERT(write(fd,"2",1) == 1);
+		errno = 0;
+		ASSERT(write(fd,"6",1) == -1);		// Black's turn
+		ASSERT(errno == EAGAIN);
+		ASSERT(ioctl(fd,SNAKE_WAIT,&wait) == 2);
+		ASSERT(write(fd,"66",2) == 1);		// Only the first move is in turn
+	}
+	else {
+		ASSERT(write(fd,"8",1) == 1);
+		usleep(50000);
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// Moves are checked a chunk at a time. An invalid move past the first chunk should still
+// only lose once the moves before it were made
+bool invalid_move_after_chunk() {
+	int n = 100, bad = 70;
+	char moves[100];
+	SETUP_OPEN_SIMPLE(TRUE);
+	ASSERT(setup_loop_game(fd,moves,n));
+	if (P_IS_FATHER()) {
+		moves[bad] = 'x';
+		ASSERT(write(fd,moves,n) == -1);
+		ASSERT(ioctl(fd,SNAKE_GET_WINNER) == BLACK_COLOR);
+	}
+	else {
+		ASSERT(write(fd,moves,bad) == bad);
+		usleep(10000);
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
 // Invalid (not 2,4,6,8) move at the nth move should cause loss
 bool invalid_nth_move_loses() {
 	int i,n=5;
@@ -2077,6 +2204,246 @@ bool ioctl_no_op() {
 	return TRUE;
 }
 
+// SET_BOARD before the first move should change the board, and read() should follow
+bool set_board_before_first_move() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	if (P_IS_FATHER()) {
+		struct snake_board dims = {8,4,10};
+		char buf[BUF_SIZE(8)+1];
+		buf[BUF_SIZE(8)] = '\0';
+		ASSERT(!ioctl(fd,SNAKE_SET_BOARD,&dims));
+		dims.size = dims.snake_size = dims.hunger = 0;
+		ASSERT(!ioctl(fd,SNAKE_GET_BOARD,&dims));
+		ASSERT(dims.size == 8 && dims.snake_size == 4 && dims.hunger == 10);
+		ASSERT(read(fd,buf,BUF_SIZE(8)) == BUF_SIZE(8));
+		ASSERT(!strncmp(buf,"---------------------------\n|  1  2  3  4  .",44));	// White snake, top row
+		ASSERT(!strncmp(buf+3*9+1+7*(3*8+4),"| -1 -2 -3 -4  .",16));			// Black snake, bottom row
+		ASSERT(buf[BUF_SIZE(8)-1] == '\n');
+	}
+	else usleep(10000);	// Don't close the game on the white player
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// SET_BOARD after someone has moved should fail with EBUSY
+bool set_board_after_move() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	if (P_IS_FATHER()) {
+		struct snake_board dims = {8,4,10};
+		char move = '2';
+		ASSERT(write(fd,&move,1) == 1);
+		errno = 0;
+		ASSERT(ioctl(fd,SNAKE_SET_BOARD,&dims) == -1);
+		ASSERT(errno == EBUSY);
+		dims.size = 0;
+		ASSERT(!ioctl(fd,SNAKE_GET_BOARD,&dims));
+		ASSERT(dims.size == N);		// Still the default board
+	}
+	else usleep(10000);
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// WAIT should return at once on the caller's turn, sleep until the other player moves
+// otherwise, and give up after the timeout
+bool wait_for_turn() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	struct snake_wait wait = {-1, 0};
+	char move = '2';
+	if (P_IS_FATHER()) {
+		ASSERT(ioctl(fd,SNAKE_WAIT,&wait) == 0);		// My turn, no moves yet
+		usleep(20000);
+		ASSERT(write(fd,&move,1) == 1);
+		wait.timeout = 10;
+		errno = 0;
+		ASSERT(ioctl(fd,SNAKE_WAIT,&wait) == -1);		// Black's turn
+		ASSERT(errno == ETIMEDOUT);
+		wait.moves = 0;
+		ASSERT(ioctl(fd,SNAKE_WAIT,&wait) == 1);		// ...but a move was made
+	}
+	else {
+		wait.timeout = 2000;
+		ASSERT(ioctl(fd,SNAKE_WAIT,&wait) == 1);		// Sleeps until white moves
+		usleep(50000);
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// SET_BOARD should refuse boards with no room for the snakes and food
+bool set_board_bad_dimensions() {
+	SETUP_OPEN_SIMPLE(FALSE);
+	struct snake_board bad[] = {{0,3,5},{1,1,5},{2,2,5},{4,5,5},{4,3,0},{MAX_N+1,3,5}};
+	int i;
+	for (i=0; i<sizeof(bad)/sizeof(*bad); ++i) {
+		errno = 0;
+		ASSERT(ioctl(fd,SNAKE_SET_BOARD,bad+i) == -1);
+		ASSERT(errno == EINVAL);
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// SET_READ_FORMAT should switch read() between the text and the binary snapshot
+bool read_format_binary() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	if (P_IS_FATHER()) {
+		char buf[SNAKE_SNAPSHOT_SIZE(N,sizeof(Cell))];
+		struct snake_snapshot* snap = (struct snake_snapshot*)buf;
+		Cell* cells = (Cell*)SNAKE_CELLS(snap);
+		Matrix m;
+		int i,j;
+		ASSERT(read_and_parse(fd,&m));
+		ASSERT(!ioctl(fd,SNAKE_SET_READ_FORMAT,SNAKE_READ_BINARY));
+		ASSERT(read(fd,buf,sizeof(buf)) == sizeof(buf));
+		ASSERT(snap->size == N && snap->cell_size == sizeof(Cell) && snap->moves == 0);
+		ASSERT(snap->white_length == M && snap->black_length == M);
+		ASSERT(snap->white_hunger == K && snap->black_hunger == K);
+		ASSERT(snap->turn == WHITE_COLOR && snap->winner == -1);
+		for (i=0; i<N; ++i)
+			for (j=0; j<N; ++j)
+				if (m[i][j] != FOOD)
+					ASSERT(cells[i*N+j] == (m[i][j] > 0 ? WHITE : m[i][j] < 0 ? BLACK : EMPTY));
+		ASSERT(!ioctl(fd,SNAKE_SET_READ_FORMAT,SNAKE_READ_TEXT));
+		ASSERT(read_and_parse(fd,&m));
+		errno = 0;
+		ASSERT(ioctl(fd,SNAKE_SET_READ_FORMAT,SNAKE_READ_BINARY+1) == -1);
+		ASSERT(errno == EINVAL);
+	}
+	else usleep(10000);
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// In event format, each read should return the moves made since the last one
+bool read_format_events() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	struct snake_event events[4];
+	char move = P_IS_FATHER() ? '2' : '8';
+	ASSERT(!ioctl(fd,SNAKE_SET_READ_FORMAT,SNAKE_READ_EVENTS));
+	if (P_IS_FATHER()) {
+		ASSERT(read(fd,events,sizeof(events)) == 0);		// Nothing happened yet
+		ASSERT(write(fd,&move,1) == 1);
+		ASSERT(read(fd,events,sizeof(events)) == sizeof(*events));
+		ASSERT(events[0].number == 0 && events[0].player == WHITE_COLOR && events[0].direction == '2');
+		ASSERT(events[0].winner == -1 && events[0].food_x >= 0 && events[0].food_y >= 0);
+		ASSERT(read(fd,events,sizeof(events)) == 0);
+		errno = 0;
+		ASSERT(read(fd,events,sizeof(*events)-1) == -1);	// Too small for an event
+		ASSERT(errno == EINVAL);
+		usleep(10000);		// Let black move and read before the game is closed
+	}
+	else {
+		ASSERT(write(fd,&move,1) == 1);					// Waits for white's move
+		ASSERT(read(fd,events,sizeof(events)) == 2*sizeof(*events));
+		ASSERT(events[0].player == WHITE_COLOR && events[1].player == BLACK_COLOR);
+		ASSERT(events[1].number == 1 && events[1].direction == '8');
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// The release gets an event of its own, which can be read after the game was released.
+// Once it was read, reads fail as they do in other formats
+bool read_events_after_release() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	struct snake_event events[4];
+	if (P_IS_FATHER()) {
+		ASSERT(!ioctl(fd,SNAKE_SET_READ_FORMAT,SNAKE_READ_EVENTS));
+		usleep(20000);		// Let black close the game
+		ASSERT(read(fd,events,sizeof(events)) == sizeof(*events));
+		ASSERT(events[0].winner == -10 && events[0].player == 0);
+		errno = 0;
+		ASSERT(read(fd,events,sizeof(events)) == -1);
+		ASSERT(errno == 10);
+	}
+	else usleep(10000);		// Give white time to set the format
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+/* ***************************
+ POLL TESTS
+*****************************/
+
+// poll() should say whose turn it is, when there's a new board to read and when the
+// other player has released the game
+bool poll_turns_and_release() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	CREATE_BUF();
+	struct pollfd pfd = {fd, POLLIN|POLLOUT, 0};
+	char move = '2';
+	if (P_IS_FATHER()) {
+		ASSERT(poll(&pfd,1,0) == 1);
+		ASSERT(pfd.revents == (POLLIN|POLLOUT));		// My turn, and I haven't read yet
+		ASSERT(read(fd,buf,GOOD_BUF_SIZE) == GOOD_BUF_SIZE);
+		ASSERT(poll(&pfd,1,0) == 1);
+		ASSERT(pfd.revents == POLLOUT);					// Nothing new to read
+		ASSERT(write(fd,&move,1) == 1);
+		ASSERT(poll(&pfd,1,0) == 1);
+		ASSERT(pfd.revents == POLLIN);					// Black's turn, and the board changed
+		ASSERT(read(fd,buf,GOOD_BUF_SIZE) == GOOD_BUF_SIZE);
+		ASSERT(poll(&pfd,1,2000) == 1);					// Wait for black to close
+		ASSERT(pfd.revents & POLLHUP);
+		ASSERT(!(pfd.revents & POLLOUT));
+	}
+	else {
+		pfd.events = POLLOUT;
+		ASSERT(poll(&pfd,1,2000) == 1);					// Wait for white to move
+		ASSERT(pfd.revents == POLLOUT);
+	}
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+/* ***************************
+ MMAP TESTS
+*****************************/
+
+// The snapshot should match the board read() shows, and follow the moves
+bool mmap_shows_board() {
+	SETUP_OPEN_SIMPLE(TRUE);
+	if (P_IS_FATHER()) {
+		struct snake_snapshot* snap = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+		ASSERT(snap != MAP_FAILED);
+		ASSERT(!(snap->seq & 1));
+		ASSERT(snap->size == N && snap->cell_size == sizeof(Cell));
+		ASSERT(snap->white_length == M && snap->black_length == M);
+		ASSERT(snap->white_hunger == K && snap->black_hunger == K);
+		ASSERT(snap->turn == WHITE_COLOR && snap->winner == -1 && snap->moves == 0);
+		Matrix m;
+		Cell* cells = (Cell*)SNAKE_CELLS(snap);
+		int i,j;
+		ASSERT(read_and_parse(fd,&m));
+		for (i=0; i<N; ++i)
+			for (j=0; j<N; ++j) {
+				if (m[i][j] == EMPTY) ASSERT(cells[i*N+j] == EMPTY);
+				else if (m[i][j] == FOOD) ASSERT(cells[i*N+j] != EMPTY && cells[i*N+j] != WHITE && cells[i*N+j] != BLACK);
+				else ASSERT(cells[i*N+j] == (m[i][j] > 0 ? WHITE : BLACK));
+			}
+		unsigned int seq = snap->seq;
+		char move = '2';
+		ASSERT(write(fd,&move,1) == 1);
+		ASSERT(snap->seq != seq && !(snap->seq & 1));
+		ASSERT(snap->moves == 1 && snap->turn == BLACK_COLOR && snap->white_hunger == K-1);
+		ASSERT(cells[N] == WHITE);	// The new head
+		munmap(snap, getpagesize());
+	}
+	else usleep(10000);
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
+// The snapshot is read only
+bool mmap_write_fails() {
+	SETUP_OPEN_SIMPLE(FALSE);
+	errno = 0;
+	ASSERT(mmap(NULL, getpagesize(), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED);
+	ASSERT(errno == EACCES);
+	DESTROY_CLOSE_SIMPLE();
+	return TRUE;
+}
+
 /*******************************************************************************************
  ===========================================================================================
  ===========================================================================================
@@ -2117,6 +2484,8 @@ int main() {
 	RUN_TEST(read_N_lt_grid_returns_N);
 	RUN_TEST(read_N_eq_grid_returns_N);
 	RUN_TEST(read_N_gt_grid_returns_N);
+	RUN_TEST(read_in_pieces);
+	RUN_TEST(read_seek_to_row);
 	RUN_TEST(read_after_release);
 	RUN_TEST(many_readers_while_releasing_p);
 	RUN_TEST(many_readers_while_releasing_t);
@@ -2134,9 +2503,13 @@ int main() {
 	RUN_TEST(move_to_tail);
 	RUN_TEST(single_write_turns);
 	RUN_TEST(bulk_write_turns);
+	RUN_TEST(write_long_stream);
+	RUN_TEST(write_queued);
+	RUN_TEST(write_nonblock);
 	RUN_TEST(multiple_white_writers);
 	RUN_TEST(invalid_move_loses);
 	RUN_TEST(invalid_nth_move_loses);
+	RUN_TEST(invalid_move_after_chunk);
 	RUN_TEST(write_null_chars);
 	RUN_TEST(write_0_chars);
 	RUN_TEST(write_N_chars);
@@ -2153,6 +2526,20 @@ int main() {
 	RUN_TEST(color_before_after_win);
 	RUN_TEST(color_fail_after_close);
 	RUN_TEST(ioctl_no_op);
+	RUN_TEST(set_board_before_first_move);
+	RUN_TEST(set_board_after_move);
+	RUN_TEST(set_board_bad_dimensions);
+	RUN_TEST(wait_for_turn);
+	RUN_TEST(read_format_binary);
+	RUN_TEST(read_format_events);
+	RUN_TEST(read_events_after_release);
+	
+	TEST_AREA("poll");
+	RUN_TEST(poll_turns_and_release);
+	
+	TEST_AREA("mmap");
+	RUN_TEST(mmap_shows_board);
+	RUN_TEST(mmap_write_fails);
 	
 	// That's all folks
 	END_TESTS();
@@ -13,6 +13,8 @@
 #include "snake.h"		// For the ioctl functions
 #include "hw3q1.h"		// For some definitions
 #include <sys/ioctl.h>
+#include <sys/mman.h>	// For mmap()
+#include <poll.h>		// For poll()
 
 // Set this to 1 if you want to see the output of PRINT
 #define HW4_TEST_DEBUG 0
@@ -554,6 +556,16 @@ bool is_adjacent(Matrix* m, int x, int y, int val) {
 	return get_adjacent(m,x,y,val,&dud,&dud);
 }
 
+// Returns TRUE if there are no EMPTY or FOOD slots left in the grid
+bool is_full_grid(Matrix* m) {
+	int i,j;
+	for (i=0; i<N; ++i)
+		for (j=0; j<N; ++j)
+			if ((*m)[i][j] == EMPTY || (*m)[i][j] == FOOD)
+				return FALSE;
+	return TRUE;
+}
+
 // Returns TRUE if the grid sent is a valid printout of a grid in ANY state.
 bool is_good_grid(Matrix* m) {
 	
@@ -571,7 +583,7 @@ bool is_good_grid(Matrix* m) {
 	if (total_food != 1) {
 		return FALSE;
 	}
-	if (total_food == 0 && !IsMatrixFull(m)) {
+	if (total_food == 0 && !is_full_grid(m)) {
 		return FALSE;
 	}
 	
@@ -648,6 +660,26 @@ void print_board(int fd) {
 	else printf("Board:\n%s",buf);
 }
 
+// Moves that walk a snake of up to 4 segments around a 2x2 square, starting from the
+// white snake's head (top left corner) or the black snake's head (bottom left corner)
+#define WHITE_LOOP "6248"
+#define BLACK_LOOP "6842"
+
+// Fills moves with n moves that walk the caller's snake around its 2x2 square. The father
+// (the white player) gives the game the largest board, with snakes of 1 segment that never
+// starve, so the snakes can play as long as they like and never meet.
+// Returns FALSE if the board couldn't be set.
+bool setup_loop_game(int fd, char* moves, int n) {
+	int i;
+	for (i=0; i<n; ++i)
+		moves[i] = P_IS_FATHER() ? WHITE_LOOP[i%4] : BLACK_LOOP[i%4];
+	if (P_IS_FATHER()) {
+		struct snake_board dims = {MAX_N, 1, 1<<30};
+		return !ioctl(fd,SNAKE_SET_BOARD,&dims);
+	}
+	return TRUE;
+}
+
 // Performs some legal move (assumes such a move is possible).
 // If no such move is possible, does nothing
 void do_legal_move(int fd) {
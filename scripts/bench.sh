@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Go home
+cd /root/hw4
+
+# Copy
+/mnt/hgfs/HW/234123-hw4/scripts/update_files.sh
+
+# Compile and run once for every cell encoding
+for bits in 8 16 32; do
+	make clean
+	make CELL_BITS=$bits
+	make bench CELL_BITS=$bits
+
+	# Allow usage
+	chmod a+x ./bench_snake
+
+	# Run
+	./bench_snake
+done
+
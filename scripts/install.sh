@@ -3,16 +3,20 @@
 # Go to the correct directory
 cd /root/hw4
 
-# Make sure the input is OK - we expect to get N (total number of games allowed)
-if [ "$#" -ne 1 ]; then
-	echo "Need to provide an argument. Usage: install.sh [TOTAL_GAMES]"; exit 1
+# Make sure the input is OK - we expect to get N (total number of games allowed), and
+# optionally a seed for the food placement (same seed, same food every run)
+if [ "$#" -lt 1 ] || [ "$#" -gt 2 ]; then
+	echo "Need to provide an argument. Usage: install.sh [TOTAL_GAMES] [FOOD_SEED]"; exit 1
 fi
 if ! [[ $1 != *[!0-9]* ]]; then
-   echo "Error: argument not a number. Usage: install.sh [TOTAL_GAMES]"; exit 2
+   echo "Error: argument not a number. Usage: install.sh [TOTAL_GAMES] [FOOD_SEED]"; exit 2
+fi
+if [ "$#" -eq 2 ] && ! [[ $2 != *[!0-9]* ]]; then
+   echo "Error: argument not a number. Usage: install.sh [TOTAL_GAMES] [FOOD_SEED]"; exit 2
 fi
 
 # Install the module (no cleanup or building)
-insmod ./snake.o max_games=$1
+insmod ./snake.o max_games=$1 ${2:+food_seed=$2}
 
 # Acquire the MAJOR number
 major=`cat /proc/devices | grep snake | sed 's/ snake//'`
@@ -10,6 +10,7 @@ cp -vr /mnt/hgfs/HW/234123-hw4/our_files/* ./
 cp -vr /mnt/hgfs/HW/234123-hw4/course_files/snake.h ./
 cp -vr /mnt/hgfs/HW/234123-hw4/scripts/*install.sh ./
 cp -vr /mnt/hgfs/HW/234123-hw4/scripts/test*.sh ./
+cp -vr /mnt/hgfs/HW/234123-hw4/scripts/bench.sh ./
 cp -vr /mnt/hgfs/HW/234123-hw4/tests/* ./
 
 # Unixify